@@ -5,6 +5,9 @@ using namespace esp32::foundation;
 
 SerialCLI serialCli(Serial);
 
+// collects the lines of an import, a line of the CLI holds at most 1024 characters
+String importText;
+
 IntegerParameter sleepDuration(
     "sleep_duration", // parameter name
     1000,  // default value
@@ -64,6 +67,66 @@ void setup()
         return true;
     }, "Delete parameter.");
 
+    serialCli.On("begin", [&]() -> bool
+    {
+        return DefaultParameterSet.BeginTransaction();
+    }, "Collect the following changes.");
+
+    serialCli.On("commit", [&]() -> bool
+    {
+        return DefaultParameterSet.Commit(true);
+    }, "Apply and save the collected changes.");
+
+    serialCli.On("rollback", [&]() -> bool
+    {
+        DefaultParameterSet.Rollback();
+        return true;
+    }, "Discard the collected changes.");
+
+    serialCli.On("heap", [&]() -> bool
+    {
+        HeapStats::Print(Serial);
+        HeapStats::ResetPeaks();
+        return true;
+    }, "Print the heap usage per component.");
+
+    serialCli.On("stats", [&]() -> bool
+    {
+        DefaultParameterSet.PrintTelemetry(Serial);
+        return true;
+    }, "Print the save and reload statistics.");
+
+    serialCli.On("export", [&](const String& prefix) -> bool
+    {
+        // printed as import commands, which can be pasted into the CLI of another device
+        std::vector<uint8_t> data;
+        DefaultParameterSet.Export(data, prefix);
+        const String text = StringUtils::ToBase64(data.data(), data.size());
+        for (uint32_t i = 0; i < text.length(); i += 64)
+        {
+            Serial.print("import ");
+            Serial.println(text.substring(i, i + 64));
+        }
+        Serial.println("import end");
+        return true;
+    }, "Export the parameters (with a prefix).");
+
+    serialCli.On("import", [&](const String& arg) -> bool
+    {
+        if (arg != "end")
+        {
+            importText += arg;
+            return true;
+        }
+
+        // inside a transaction of the begin command the keys are saved by commit
+        std::vector<uint8_t> data;
+        const bool imported = StringUtils::FromBase64(importText, data) &&
+            DefaultParameterSet.Import(data.data(), data.size(), !DefaultParameterSet.IsInTransaction());
+        importText = "";
+        return imported;
+    }, "Import exported parameters.");
+
     delay(3000);
     serialCli.PrintCommands();
 }
@@ -0,0 +1,381 @@
+#include <Arduino.h>
+#include <Esp32Foundation.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cinttypes>
+#include <memory>
+#include <vector>
+
+using namespace esp32::foundation;
+
+// prints one JSON object per line, so the results can be collected from the serial log
+void printResult(const char* bench, const uint32_t keys, const char* api, const uint32_t ops, const uint32_t micros)
+{
+    Serial.printf(
+        "{\"bench\":\"%s\",\"keys\":%" PRIu32 ",\"api\":\"%s\",\"ops\":%" PRIu32 ",\"ns_per_op\":%.1f}\n",
+        bench, keys, api, ops, micros * 1000.0f / ops);
+}
+
+void printMetric(const char* bench, const uint32_t keys, const char* metric, const uint32_t value)
+{
+    Serial.printf("{\"bench\":\"%s\",\"keys\":%" PRIu32 ",\"metric\":\"%s\",\"value\":%" PRIu32 "}\n", bench, keys, metric, value);
+}
+
+// live heap blocks and bytes, the difference of two samples is what was allocated in between
+struct HeapSample
+{
+    uint32_t Blocks;
+    uint32_t Bytes;
+};
+
+HeapSample sampleHeap()
+{
+    // counted by HeapStats if it is compiled in, e.g. on the host, which has no heap_caps
+    if (HeapStats::IsEnabled())
+    {
+        HeapSample sample = {0, 0};
+        for (uint32_t i = 0; i < HS_COUNT; i++)
+        {
+            const HeapUsage usage = HeapStats::GetUsage((HeapSubsystem)i);
+            sample.Blocks += usage.Allocations - usage.Frees;
+            sample.Bytes += usage.Bytes;
+        }
+        return sample;
+    }
+
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+    return {(uint32_t)info.allocated_blocks, (uint32_t)info.total_allocated_bytes};
+}
+
+void printHeap(const char* bench, const uint32_t keys, const HeapSample& before)
+{
+    const HeapSample after = sampleHeap();
+    printMetric(bench, keys, "heap_blocks", after.Blocks - before.Blocks);
+    printMetric(bench, keys, "heap_bytes", after.Bytes - before.Bytes);
+}
+
+// the largest sets do not fit into the heap of every board
+bool fitsIntoHeap(const char* bench, const uint32_t keys, const uint32_t bytesPerKey)
+{
+    if (heap_caps_get_free_size(MALLOC_CAP_8BIT) > keys * bytesPerKey)
+    {
+        return true;
+    }
+    printMetric(bench, keys, "skipped", 1);
+    return false;
+}
+
+// the allocations counted by HeapStats, only available with -D ESP32_FOUNDATION_HEAP_STATS
+void printHeapStats(const char* bench, const uint32_t keys)
+{
+    for (uint32_t i = 0; i < HS_COUNT && HeapStats::IsEnabled(); i++)
+    {
+        const HeapUsage usage = HeapStats::GetUsage((HeapSubsystem)i);
+        Serial.printf(
+            "{\"bench\":\"%s\",\"keys\":%" PRIu32 ",\"subsystem\":\"%s\",\"allocs\":%" PRIu32 ",\"frees\":%" PRIu32 ",\"bytes\":%" PRIu32 ",\"peak_bytes\":%" PRIu32 "}\n",
+            bench, keys, HeapStats::GetName((HeapSubsystem)i), usage.Allocations, usage.Frees, usage.Bytes, usage.PeakBytes);
+    }
+    HeapStats::ResetPeaks();
+}
+
+void createKeyName(const uint32_t i, char* name, const uint32_t size)
+{
+    snprintf(name, size, "key_%05" PRIu32, i);
+}
+
+void benchmarkLookup(const uint32_t keyCount)
+{
+    const uint32_t rounds = 100000 / keyCount;
+
+    KeyValueStorage storage("bench");
+    std::vector<String> names;
+    std::vector<HashedKey> hashedKeys;
+    for (uint32_t i = 0; i < keyCount; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "key_%04" PRIu32, i);
+        names.push_back(name);
+        storage.Set(names.back(), i);
+    }
+    for (auto& name : names)
+    {
+        hashedKeys.push_back(HashedKey(name.c_str()));
+    }
+
+    uint32_t found = 0;
+    uint32_t start = micros();
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        for (auto& name : names)
+        {
+            found += storage.GetKeyId(name) >= 0;
+        }
+    }
+    printResult("lookup", keyCount, "String", rounds * keyCount, micros() - start);
+
+    start = micros();
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        for (auto& name : names)
+        {
+            found += storage.GetKeyId(name.c_str()) >= 0;
+        }
+    }
+    printResult("lookup", keyCount, "const char*", rounds * keyCount, micros() - start);
+
+    start = micros();
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        for (auto& key : hashedKeys)
+        {
+            found += storage.GetKeyId(key) >= 0;
+        }
+    }
+    printResult("lookup", keyCount, "HashedKey", rounds * keyCount, micros() - start);
+
+    if (found != 3 * rounds * keyCount)
+    {
+        Serial.println("lookup failed");
+    }
+}
+
+// typical configuration content: URLs, certificate fingerprints and small JSON documents
+void createConfigBlob(const uint32_t keyCount, std::vector<uint8_t>& blob)
+{
+    for (uint32_t i = 0; i < keyCount; i++)
+    {
+        char entry[160];
+        int size = 0;
+        switch (i % 3)
+        {
+        case 0:
+            size = snprintf(entry, sizeof(entry), "mqtt_url_%" PRIu32 "%chttps://broker.example.com:8883/devices/%" PRIu32 "/telemetry", i, 0, i);
+            break;
+        case 1:
+            size = snprintf(entry, sizeof(entry), "tls_fp_%" PRIu32 "%c%08" PRIX32 "%08" PRIX32 "%08" PRIX32 "%08" PRIX32 "%08" PRIX32, i, 0, i * 2654435761u, i * 40503u, i ^ 0x5A5A5A5Au, i * 97u, i * 7919u);
+            break;
+        default:
+            size = snprintf(entry, sizeof(entry), "sensor_%" PRIu32 "%c{\"interval\":%" PRIu32 ",\"enabled\":true,\"unit\":\"celsius\"}", i, 0, i * 10);
+            break;
+        }
+        blob.insert(blob.end(), entry, entry + size + 1);
+    }
+}
+
+void benchmarkCompression(const uint32_t keyCount)
+{
+    const uint32_t rounds = 20;
+
+    std::vector<uint8_t> blob;
+    createConfigBlob(keyCount, blob);
+
+    std::vector<uint8_t> compressed;
+    uint32_t start = micros();
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        compressed.clear();
+        Compression::Compress(blob.data(), blob.size(), compressed);
+    }
+    printResult("compress", keyCount, "Compress", rounds, micros() - start);
+
+    std::vector<uint8_t> decompressed(blob.size());
+    bool ok = true;
+    start = micros();
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        ok &= Compression::Decompress(compressed.data(), compressed.size(), decompressed.data(), decompressed.size());
+    }
+    printResult("compress", keyCount, "Decompress", rounds, micros() - start);
+
+    Serial.printf(
+        "{\"bench\":\"compress\",\"keys\":%" PRIu32 ",\"raw_bytes\":%u,\"compressed_bytes\":%u,\"ratio\":%.2f}\n",
+        keyCount, (unsigned)blob.size(), (unsigned)compressed.size(), (float)blob.size() / compressed.size());
+
+    if (!ok || decompressed != blob)
+    {
+        Serial.println("decompression failed");
+    }
+}
+
+// Set, Get, Save and Reload on a RamBackend, so the results do not depend on the flash
+void benchmarkStorage(const uint32_t keyCount)
+{
+    if (!fitsIntoHeap("storage", keyCount, 160))
+    {
+        return;
+    }
+
+    const uint32_t rounds = std::max<uint32_t>(1, 100000 / keyCount);
+    const uint32_t saveRounds = std::max<uint32_t>(1, 1000 / keyCount);
+
+    RamBackend backend;
+    const HeapSample heap = sampleHeap();
+    {
+        KeyValueStorage storage("bench");
+        storage.SetBackend(backend);
+        storage.Load();
+
+        uint32_t start = micros();
+        for (uint32_t i = 0; i < keyCount; i++)
+        {
+            char name[16];
+            createKeyName(i, name, sizeof(name));
+            storage.Set(String(name), i);
+        }
+        printResult("storage", keyCount, "Set(insert)", keyCount, micros() - start);
+        printHeap("storage", keyCount, heap);
+
+        start = micros();
+        for (uint32_t r = 0; r < rounds; r++)
+        {
+            for (int32_t keyId = 0; keyId < (int32_t)keyCount; keyId++)
+            {
+                storage.Set(keyId, r);
+            }
+        }
+        printResult("storage", keyCount, "Set(update)", rounds * keyCount, micros() - start);
+
+        uint32_t sum = 0;
+        start = micros();
+        for (uint32_t r = 0; r < rounds; r++)
+        {
+            for (int32_t keyId = 0; keyId < (int32_t)keyCount; keyId++)
+            {
+                uint32_t value = 0;
+                storage.Get(keyId, value);
+                sum += value;
+            }
+        }
+        printResult("storage", keyCount, "Get", rounds * keyCount, micros() - start);
+
+        start = micros();
+        for (uint32_t r = 0; r < saveRounds; r++)
+        {
+            storage.Set(0, r);
+            storage.Save();
+        }
+        printResult("storage", keyCount, "Save", saveRounds, micros() - start);
+        printMetric("storage", keyCount, "serialized_bytes", backend.GetUsedBytes());
+
+        start = micros();
+        for (uint32_t r = 0; r < saveRounds; r++)
+        {
+            storage.Reload();
+        }
+        printResult("storage", keyCount, "Reload", saveRounds, micros() - start);
+
+        if (storage.GetKeyCount() != keyCount || sum != keyCount * rounds * (rounds - 1))
+        {
+            Serial.println("storage failed");
+        }
+    }
+    printHeapStats("storage", keyCount);
+}
+
+// typed reads and writes of parameters that live in a RamBackend
+void benchmarkParameters(const uint32_t keyCount)
+{
+    if (!fitsIntoHeap("parameters", keyCount, 320))
+    {
+        return;
+    }
+
+    const uint32_t rounds = std::max<uint32_t>(1, 100000 / keyCount);
+
+    RamBackend backend;
+    const HeapSample heap = sampleHeap();
+    {
+        ParameterSet paramSet("benchp");
+        paramSet.SetBackend(backend);
+
+        std::vector<std::unique_ptr<IntegerParameter>> integers;
+        std::vector<std::unique_ptr<FloatParameter>> floats;
+        for (uint32_t i = 0; i < keyCount; i++)
+        {
+            char name[16];
+            createKeyName(i, name, sizeof(name));
+            if (i % 2 == 0)
+            {
+                integers.emplace_back(new IntegerParameter(name, 0, INT32_MIN, INT32_MAX, paramSet));
+            }
+            else
+            {
+                floats.emplace_back(new FloatParameter(name, 0.0f, 2, -1e9f, 1e9f, paramSet));
+            }
+        }
+        paramSet.Load();
+        printHeap("parameters", keyCount, heap);
+
+        uint32_t start = micros();
+        for (uint32_t r = 0; r < rounds; r++)
+        {
+            for (auto& param : integers)
+            {
+                *param = r;
+            }
+            for (auto& param : floats)
+            {
+                *param = r * 0.5f;
+            }
+        }
+        printResult("parameters", keyCount, "write", rounds * keyCount, micros() - start);
+
+        int64_t integerSum = 0;
+        float floatSum = 0.0f;
+        start = micros();
+        for (uint32_t r = 0; r < rounds; r++)
+        {
+            for (auto& param : integers)
+            {
+                integerSum += (int32_t)*param;
+            }
+            for (auto& param : floats)
+            {
+                floatSum += (float)*param;
+            }
+        }
+        printResult("parameters", keyCount, "read", rounds * keyCount, micros() - start);
+
+        start = micros();
+        paramSet.Save();
+        printResult("parameters", keyCount, "Save", 1, micros() - start);
+        printMetric("parameters", keyCount, "serialized_bytes", backend.GetUsedBytes());
+
+        if (integerSum != (int64_t)(rounds - 1) * rounds * (int64_t)integers.size() || floatSum < 0.0f)
+        {
+            Serial.println("parameters failed");
+        }
+    }
+    printHeapStats("parameters", keyCount);
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    delay(3000);
+
+    // a constant key is hashed by the compiler
+    static constexpr HashedKey constantKey("key_0000");
+    static_assert(constantKey.Hash == HashKey("key_0000"), "HashKey is not constexpr");
+
+    benchmarkLookup(16);
+    benchmarkLookup(128);
+    benchmarkLookup(1024);
+
+    benchmarkCompression(16);
+    benchmarkCompression(128);
+    benchmarkCompression(1024);
+
+    const uint32_t keyCounts[] = {10, 100, 1000, 10000};
+    for (const uint32_t keyCount : keyCounts)
+    {
+        benchmarkStorage(keyCount);
+        benchmarkParameters(keyCount);
+    }
+}
+
+void loop()
+{
+    delay(1000);
+}
@@ -0,0 +1,8 @@
+// runs an Arduino sketch once on the host, loop() is not called
+void setup();
+
+int main()
+{
+    setup();
+    return 0;
+}
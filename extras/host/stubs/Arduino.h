@@ -0,0 +1,192 @@
+#pragma once
+// Host stand-in for the parts of the Arduino core the library uses, not a full implementation.
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <thread>
+
+#define F(x) x
+#define PROGMEM
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class String
+{
+public:
+    String() {}
+    String(const char *value) : _s(value != nullptr ? value : "") {}
+    String(const std::string &value) : _s(value) {}
+    String(const char value) : _s(1, value) {}
+    String(const int value) : _s(std::to_string(value)) {}
+    String(const unsigned int value) : _s(std::to_string(value)) {}
+    String(const long value) : _s(std::to_string(value)) {}
+    String(const unsigned long value) : _s(std::to_string(value)) {}
+    String(const long long value) : _s(std::to_string(value)) {}
+    String(const unsigned long long value) : _s(std::to_string(value)) {}
+    String(const float value, const int decimalPlaces = 2) : String((double)value, decimalPlaces) {}
+    String(const double value, const int decimalPlaces = 2)
+    {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*f", decimalPlaces, value);
+        _s = buffer;
+    }
+
+    const char *c_str() const { return _s.c_str(); }
+    unsigned int length() const { return _s.size(); }
+    bool isEmpty() const { return _s.empty(); }
+    void reserve(const size_t size) { _s.reserve(size); }
+    void clear() { _s.clear(); }
+    bool concat(const char *value, const unsigned int length)
+    {
+        _s.append(value, length);
+        return true;
+    }
+
+    void trim()
+    {
+        while (!_s.empty() && isspace((unsigned char)_s.back()))
+            _s.pop_back();
+        size_t start = 0;
+        while (start < _s.size() && isspace((unsigned char)_s[start]))
+            start++;
+        _s.erase(0, start);
+    }
+
+    void toLowerCase()
+    {
+        for (auto &c : _s)
+            c = tolower(c);
+    }
+
+    bool startsWith(const String &prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+    bool endsWith(const String &suffix) const
+    {
+        return _s.size() >= suffix._s.size() && _s.compare(_s.size() - suffix._s.size(), suffix._s.size(), suffix._s) == 0;
+    }
+
+    int indexOf(const String &value) const { return ToIndex(_s.find(value._s)); }
+    int indexOf(const char value, const unsigned int from = 0) const { return ToIndex(_s.find(value, from)); }
+    String substring(const unsigned int from) const { return from >= _s.size() ? String() : String(_s.substr(from)); }
+    String substring(const unsigned int from, const unsigned int to) const
+    {
+        return from >= _s.size() ? String() : String(_s.substr(from, to - from));
+    }
+    void remove(const unsigned int index, const unsigned int count = 1) { _s.erase(index, count); }
+
+    long toInt() const { return atol(_s.c_str()); }
+    float toFloat() const { return atof(_s.c_str()); }
+
+    char operator[](const unsigned int index) const { return _s[index]; }
+    char &operator[](const unsigned int index) { return _s[index]; }
+    String &operator+=(const String &value) { _s += value._s; return *this; }
+    String &operator+=(const char *value) { _s += value; return *this; }
+    String &operator+=(const char value) { _s += value; return *this; }
+    bool operator==(const String &other) const { return _s == other._s; }
+    bool operator==(const char *other) const { return _s == other; }
+    bool operator!=(const String &other) const { return _s != other._s; }
+    bool operator<(const String &other) const { return _s < other._s; }
+    bool equals(const String &other) const { return _s == other._s; }
+
+    friend String operator+(const String &a, const String &b) { return String(a._s + b._s); }
+
+private:
+    static int ToIndex(const size_t index) { return index == std::string::npos ? -1 : (int)index; }
+
+    std::string _s;
+};
+
+inline String operator+(const String &a, const char *b) { return a + String(b); }
+inline String operator+(const char *a, const String &b) { return String(a) + b; }
+inline String operator+(const String &a, const char b) { return a + String(b); }
+inline String operator+(const String &a, const int b) { return a + String(b); }
+inline String operator+(const String &a, const unsigned int b) { return a + String(b); }
+inline String operator+(const String &a, const long b) { return a + String(b); }
+inline String operator+(const String &a, const unsigned long b) { return a + String(b); }
+inline String operator+(const String &a, const float b) { return a + String(b); }
+
+class Print
+{
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(const uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+    virtual size_t write(const uint8_t *buffer, const size_t size) { return fwrite(buffer, 1, size, stdout); }
+
+    size_t print(const String &value) { return write((const uint8_t *)value.c_str(), value.length()); }
+    size_t print(const char *value) { return print(String(value)); }
+    size_t print(const char value) { return write((uint8_t)value); }
+    size_t print(const int value) { return print(String(value)); }
+    size_t print(const unsigned int value) { return print(String(value)); }
+    size_t print(const long value) { return print(String(value)); }
+    size_t print(const unsigned long value) { return print(String(value)); }
+    size_t print(const long long value) { return print(String(value)); }
+    size_t print(const unsigned long long value) { return print(String(value)); }
+    size_t print(const double value, const int decimalPlaces = 2) { return print(String(value, decimalPlaces)); }
+    size_t println() { return print("\n"); }
+    template <typename T>
+    size_t println(const T &value) { return print(value) + println(); }
+    size_t println(const double value, const int decimalPlaces) { return print(value, decimalPlaces) + println(); }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buffer[512];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        return print(buffer);
+    }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    void flush() { fflush(stdout); }
+    void setTimeout(const unsigned long) {}
+    size_t readBytes(uint8_t *, const size_t) { return 0; }
+    String readStringUntil(const char) { return String(); }
+};
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(const unsigned long) {}
+};
+
+extern HardwareSerial Serial;
+
+struct EspClass
+{
+    uint32_t getFreeHeap() { return 100000; }
+    uint32_t getMinFreeHeap() { return 90000; }
+    uint32_t getMaxAllocHeap() { return 50000; }
+    void restart() { exit(0); }
+};
+
+extern EspClass ESP;
+
+inline unsigned long millis()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline unsigned long micros()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void delay(const unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
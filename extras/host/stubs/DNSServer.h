@@ -0,0 +1,17 @@
+#pragma once
+// Host stand-in, only lets the headers of the portal compile.
+#include <WebServer.h>
+
+namespace DNSReplyCode
+{
+    const int NoError = 0;
+}
+
+class DNSServer
+{
+public:
+    bool start(const int, const String &, const IPAddress &) { return true; }
+    void stop() {}
+    void processNextRequest() {}
+    void setErrorReplyCode(const int) {}
+};
@@ -0,0 +1,2 @@
+#pragma once
+// Host stand-in, the library only includes the header.
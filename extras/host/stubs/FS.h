@@ -0,0 +1,71 @@
+#pragma once
+// Host stand-in for the Arduino file system API, the paths are relative to a host directory.
+#include <Arduino.h>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+    class File
+    {
+    public:
+        File() : _file(nullptr) {}
+        explicit File(FILE *file) : _file(file) {}
+
+        operator bool() const { return _file != nullptr; }
+
+        size_t size()
+        {
+            const long position = ftell(_file);
+            fseek(_file, 0, SEEK_END);
+            const long size = ftell(_file);
+            fseek(_file, position, SEEK_SET);
+            return size;
+        }
+
+        size_t read(uint8_t *buffer, const size_t size) { return fread(buffer, 1, size, _file); }
+        size_t write(const uint8_t *buffer, const size_t size) { return fwrite(buffer, 1, size, _file); }
+
+        void close()
+        {
+            if (_file != nullptr)
+                fclose(_file);
+            _file = nullptr;
+        }
+
+    private:
+        FILE *_file;
+    };
+
+    class FS
+    {
+    public:
+        explicit FS(const char *root) : _root(root) { ::mkdir(root, 0755); }
+
+        bool exists(const String &path)
+        {
+            struct stat info;
+            return stat(GetPath(path).c_str(), &info) == 0;
+        }
+
+        bool mkdir(const String &path) { return ::mkdir(GetPath(path).c_str(), 0755) == 0; }
+        bool remove(const String &path) { return ::unlink(GetPath(path).c_str()) == 0; }
+
+        File open(const String &path, const char *mode)
+        {
+            return File(fopen(GetPath(path).c_str(), mode[0] == 'w' ? "wb" : mode[0] == 'a' ? "ab" : "rb"));
+        }
+
+    private:
+        std::string GetPath(const String &path) const { return _root + path.c_str(); }
+
+        std::string _root;
+    };
+}
+
+using fs::File;
@@ -0,0 +1,102 @@
+#pragma once
+// Host stand-in for the NVS preferences, the namespaces live in memory for the lifetime of the process.
+#include <Arduino.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Preferences
+{
+public:
+    bool begin(const char *name, const bool readOnly = false, const char * = nullptr)
+    {
+        // NVS limits names and keys to 15 characters
+        if (strlen(name) > 15)
+            return false;
+        _name = name;
+        _isOpen = true;
+        _readOnly = readOnly;
+        return true;
+    }
+
+    void end() { _isOpen = false; }
+
+    bool clear()
+    {
+        std::lock_guard<std::mutex> lock(Mutex());
+        Data()[_name].clear();
+        return true;
+    }
+
+    bool remove(const char *key)
+    {
+        std::lock_guard<std::mutex> lock(Mutex());
+        return Data()[_name].erase(key) > 0;
+    }
+
+    bool isKey(const char *key)
+    {
+        std::lock_guard<std::mutex> lock(Mutex());
+        return Data()[_name].count(key) > 0;
+    }
+
+    size_t putUInt(const char *key, const uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+    uint32_t getUInt(const char *key, const uint32_t defaultValue = 0)
+    {
+        uint32_t value = defaultValue;
+        return getBytesLength(key) == sizeof(value) && getBytes(key, &value, sizeof(value)) ? value : defaultValue;
+    }
+
+    size_t putUChar(const char *key, const uint8_t value) { return putBytes(key, &value, sizeof(value)); }
+    uint8_t getUChar(const char *key, const uint8_t defaultValue = 0)
+    {
+        uint8_t value = defaultValue;
+        return getBytesLength(key) == sizeof(value) && getBytes(key, &value, sizeof(value)) ? value : defaultValue;
+    }
+
+    size_t putBytes(const char *key, const void *value, const size_t size)
+    {
+        if (!_isOpen || _readOnly || strlen(key) > 15)
+            return 0;
+        std::lock_guard<std::mutex> lock(Mutex());
+        Data()[_name][key].assign((const uint8_t *)value, (const uint8_t *)value + size);
+        return size;
+    }
+
+    size_t getBytesLength(const char *key)
+    {
+        std::lock_guard<std::mutex> lock(Mutex());
+        auto &data = Data()[_name];
+        auto it = data.find(key);
+        return it == data.end() ? 0 : it->second.size();
+    }
+
+    size_t getBytes(const char *key, void *buffer, const size_t size)
+    {
+        std::lock_guard<std::mutex> lock(Mutex());
+        auto &data = Data()[_name];
+        auto it = data.find(key);
+        if (it == data.end() || it->second.size() > size)
+            return 0;
+        memcpy(buffer, it->second.data(), it->second.size());
+        return it->second.size();
+    }
+
+private:
+    static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> &Data()
+    {
+        static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> data;
+        return data;
+    }
+
+    static std::mutex &Mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    std::string _name;
+    bool _isOpen = false;
+    bool _readOnly = false;
+};
@@ -0,0 +1,60 @@
+#pragma once
+// Host stand-in for the web server, only lets the headers of the portal compile.
+#include <Arduino.h>
+#include <functional>
+
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+
+enum HTTPMethod
+{
+    HTTP_GET,
+    HTTP_POST,
+    HTTP_ANY
+};
+
+class IPAddress
+{
+public:
+    IPAddress() {}
+    IPAddress(const int, const int, const int, const int) {}
+    bool fromString(const char *) { return true; }
+};
+
+class WiFiClient
+{
+public:
+    void stop() {}
+};
+
+class WebServer
+{
+public:
+    WebServer(const int = 80) {}
+
+    void on(const String &, std::function<void()>) {}
+    void on(const String &, const HTTPMethod, std::function<void()>) {}
+    void onNotFound(std::function<void()>) {}
+    void begin() {}
+    void stop() {}
+    void close() {}
+    void handleClient() {}
+
+    void setContentLength(const size_t) {}
+    void send(const int, const char *, const String &) {}
+    void send(const int, const String &, const String &) {}
+    void send_P(const int, const char *, const char *, const size_t) {}
+    void sendHeader(const String &, const String &, const bool = false) {}
+    void sendContent(const String &) {}
+    void sendContent(const char *, const size_t) {}
+    void sendContent_P(const char *) {}
+
+    int args() { return 0; }
+    String argName(const int) { return String(); }
+    String arg(const int) { return String(); }
+    String arg(const String &) { return String(); }
+    bool hasArg(const String &) { return false; }
+    String uri() { return "/"; }
+    String hostHeader() { return String(); }
+    HTTPMethod method() { return HTTP_GET; }
+    WiFiClient client() { return WiFiClient(); }
+};
@@ -0,0 +1,5 @@
+#pragma once
+// Host stand-in, only lets the headers of the WiFi client compile.
+#include <WebServer.h>
+
+typedef int WiFiEventId_t;
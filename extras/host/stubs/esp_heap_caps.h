@@ -0,0 +1,30 @@
+#pragma once
+// Host stand-in for the heap capabilities API, reports a large heap without allocations,
+// the host build measures the heap with HeapStats instead.
+#include <cstddef>
+
+#define MALLOC_CAP_8BIT 4
+
+typedef struct
+{
+    size_t total_free_bytes;
+    size_t total_allocated_bytes;
+    size_t allocated_blocks;
+} multi_heap_info_t;
+
+inline void heap_caps_get_info(multi_heap_info_t *info, const int)
+{
+    info->total_free_bytes = 1 << 30;
+    info->total_allocated_bytes = 0;
+    info->allocated_blocks = 0;
+}
+
+inline size_t heap_caps_get_free_size(const int)
+{
+    return 1 << 30;
+}
+
+inline size_t heap_caps_get_largest_free_block(const int)
+{
+    return 1 << 20;
+}
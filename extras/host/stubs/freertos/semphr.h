@@ -0,0 +1,90 @@
+#pragma once
+// Host stand-in for the FreeRTOS semaphores, all mutexes are recursive.
+#include "FreeRTOS.h"
+
+struct HostSemaphore
+{
+    std::recursive_timed_mutex Mutex;
+    // binary semaphores only
+    bool IsBinary = false;
+    bool IsGiven = false;
+    std::mutex BinaryMutex;
+    std::condition_variable Given;
+};
+
+typedef HostSemaphore *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+    return new HostSemaphore();
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new HostSemaphore();
+}
+
+// created empty like on the device
+inline SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+    SemaphoreHandle_t semaphore = new HostSemaphore();
+    semaphore->IsBinary = true;
+    return semaphore;
+}
+
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, const TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        semaphore->Mutex.lock();
+        return pdTRUE;
+    }
+    return semaphore->Mutex.try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore)
+{
+    semaphore->Mutex.unlock();
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, const TickType_t ticks)
+{
+    if (semaphore->IsBinary)
+    {
+        std::unique_lock<std::mutex> lock(semaphore->BinaryMutex);
+        const auto isGiven = [semaphore]() { return semaphore->IsGiven; };
+        if (ticks == portMAX_DELAY)
+        {
+            semaphore->Given.wait(lock, isGiven);
+        }
+        else if (!semaphore->Given.wait_for(lock, std::chrono::milliseconds(ticks), isGiven))
+        {
+            return pdFALSE;
+        }
+        semaphore->IsGiven = false;
+        return pdTRUE;
+    }
+    return xSemaphoreTakeRecursive(semaphore, ticks);
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    if (semaphore->IsBinary)
+    {
+        std::lock_guard<std::mutex> lock(semaphore->BinaryMutex);
+        if (semaphore->IsGiven)
+        {
+            return pdFALSE;
+        }
+        semaphore->IsGiven = true;
+        semaphore->Given.notify_one();
+        return pdTRUE;
+    }
+    return xSemaphoreGiveRecursive(semaphore);
+}
+
+inline void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    delete semaphore;
+}
@@ -0,0 +1,101 @@
+#pragma once
+// Host stand-in for the FreeRTOS tasks, every thread is a task and has its own notification value.
+#include "FreeRTOS.h"
+
+struct HostTask
+{
+    std::mutex Mutex;
+    std::condition_variable Notified;
+    uint32_t Notifications = 0;
+};
+
+typedef HostTask *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// the task of a thread that was not created by xTaskCreate(), e.g. the main thread
+inline HostTask *&HostCurrentTask()
+{
+    static thread_local HostTask *task = nullptr;
+    return task;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    static thread_local HostTask thread;
+    HostTask *task = HostCurrentTask();
+    return task != nullptr ? task : &thread;
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *, const uint32_t, void *parameter,
+                                          const UBaseType_t, TaskHandle_t *handle, const BaseType_t)
+{
+    // the handle is set before the task runs, like on the device
+    HostTask *task = new HostTask();
+    if (handle != nullptr)
+    {
+        *handle = task;
+    }
+
+    std::thread([task, function, parameter]() {
+        HostCurrentTask() = task;
+        function(parameter);
+        HostCurrentTask() = nullptr;
+        delete task;
+    }).detach();
+    return pdPASS;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t function, const char *name, const uint32_t stackSize, void *parameter,
+                              const UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(function, name, stackSize, parameter, priority, handle, tskNO_AFFINITY);
+}
+
+inline void vTaskDelete(TaskHandle_t)
+{
+}
+
+inline void vTaskDelay(const TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+inline TickType_t xTaskGetTickCount()
+{
+    return millis();
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    // notified while locked, so a task that terminates right after waking up does not delete it in between
+    std::lock_guard<std::mutex> lock(task->Mutex);
+    task->Notifications++;
+    task->Notified.notify_one();
+    return pdPASS;
+}
+
+inline uint32_t ulTaskNotifyTake(const BaseType_t clear, const TickType_t ticks)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->Mutex);
+    auto notified = [task]() { return task->Notifications > 0; };
+    if (ticks == portMAX_DELAY)
+    {
+        task->Notified.wait(lock, notified);
+    }
+    else
+    {
+        task->Notified.wait_for(lock, std::chrono::milliseconds(ticks), notified);
+    }
+
+    const uint32_t result = task->Notifications;
+    if (clear)
+    {
+        task->Notifications = 0;
+    }
+    else if (result > 0)
+    {
+        task->Notifications--;
+    }
+    return result;
+}
@@ -0,0 +1,135 @@
+// Blobs above the buffered size are written in chunks: they round-trip, the chunks of a smaller
+// blob replace the ones of the previous save, and the flash is written without holding a lock.
+#include <Esp32Foundation.h>
+#include <atomic>
+#include <cassert>
+#include <thread>
+
+using namespace esp32::foundation;
+
+// one key per chunk like the NVS, every write is slow while Delay is set
+class SlowBackend : public RamBackend
+{
+public:
+    std::atomic<uint32_t> Delay{0};
+    std::atomic<uint32_t> Writes{0};
+
+    virtual bool SupportsPartialWrite() const override
+    {
+        return false;
+    }
+
+    virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override
+    {
+        Writes++;
+        delay(Delay);
+        return RamBackend::Write(key, data, size);
+    }
+
+    uint32_t CountChunks(const char *name, const char *blobName)
+    {
+        uint32_t count = 0;
+        Begin(name, true);
+        for (const char *set : {".a", ".b"})
+        {
+            for (uint32_t i = 0; Exists((String(blobName) + set + i).c_str()); i++)
+            {
+                count++;
+            }
+        }
+        End();
+        return count;
+    }
+};
+
+static String valueOf(const uint32_t key, const uint32_t round)
+{
+    return String("value ") + key + " of round " + round + ", long enough for a chunked blob";
+}
+
+static void setValues(KeyValueStorage &storage, const uint32_t count, const uint32_t round)
+{
+    for (uint32_t key = 0; key < count; key++)
+    {
+        const String value = valueOf(key, round);
+        storage.Set(String("key_") + key, value.c_str(), value.length() + 1);
+    }
+}
+
+static void checkValues(const uint32_t count, const uint32_t round, StorageBackend &backend)
+{
+    KeyValueStorage reloaded("chunks");
+    reloaded.SetBackend(backend);
+    reloaded.Load();
+    assert(!reloaded.IsCorrupt() && reloaded.GetKeyCount() == count);
+    for (uint32_t key = 0; key < count; key++)
+    {
+        std::vector<uint8_t> value;
+        assert(reloaded.Get(String("key_") + key, value));
+        assert(valueOf(key, round) == (const char *)value.data());
+    }
+}
+
+static void testRoundTrip()
+{
+    SlowBackend backend;
+    KeyValueStorage storage("chunks");
+    storage.SetBackend(backend);
+    storage.Load();
+
+    setValues(storage, 200, 1);
+    storage.Save();
+    checkValues(200, 1, backend);
+    const uint32_t chunks = backend.CountChunks("chunks", "data");
+    assert(chunks > 1);
+
+    // the other chunk set is written, the chunks of the larger previous blob are removed
+    for (uint32_t key = 50; key < 200; key++)
+    {
+        storage.Unset(String("key_") + key);
+    }
+    setValues(storage, 50, 2);
+    storage.Save();
+    checkValues(50, 2, backend);
+    assert(backend.CountChunks("chunks", "data") < chunks);
+}
+
+static void testUnlockedWrites()
+{
+    SlowBackend backend;
+    KeyValueStorage storage("chunks");
+    storage.SetBackend(backend);
+    storage.EnableLocking();
+    storage.Load();
+    setValues(storage, 200, 1);
+
+    backend.Writes = 0;
+    backend.Delay = 50;
+    std::thread saver([&storage]() {
+        storage.Save();
+    });
+    while (backend.Writes == 0)
+    {
+        delay(1);
+    }
+
+    // readers and writers do not wait for the chunks to be written
+    const uint32_t start = millis();
+    std::vector<uint8_t> value;
+    assert(storage.Get(String("key_1"), value));
+    setValues(storage, 200, 2);
+    assert(millis() - start < 50);
+
+    saver.join();
+    backend.Delay = 0;
+    checkValues(200, 1, backend);
+    storage.Save();
+    checkValues(200, 2, backend);
+}
+
+void setup()
+{
+    testRoundTrip();
+    testUnlockedWrites();
+    Serial.println("ChunkTest passed");
+}
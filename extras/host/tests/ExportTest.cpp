@@ -0,0 +1,118 @@
+// Export() and Import(): the prefix selects the exported keys, an import keeps the other keys, is saved,
+// and a snapshot that is corrupted or truncated is rejected without changing the storage.
+#include <Esp32Foundation.h>
+#include <cassert>
+
+using namespace esp32::foundation;
+
+static void setString(KeyValueStorage &storage, const String &key, const String &value)
+{
+    storage.Set(key, value.c_str(), value.length() + 1);
+}
+
+static String getString(KeyValueStorage &storage, const String &key)
+{
+    std::vector<uint8_t> value;
+    assert(storage.Get(key, value) && !value.empty() && value.back() == 0);
+    return String((const char *)value.data());
+}
+
+static uint32_t getValue(KeyValueStorage &storage, const char *key)
+{
+    uint32_t value = 0;
+    assert(storage.Get(String(key), value));
+    return value;
+}
+
+static void testPrefix()
+{
+    RamBackend backend;
+    KeyValueStorage source("source");
+    source.SetBackend(backend);
+    source.Load();
+    setString(source, "mqtt_host", "broker");
+    source.Set(String("mqtt_port"), 1883u);
+    setString(source, "wifi_ssid", "home");
+
+    std::vector<uint8_t> snapshot;
+    source.Export(snapshot, "mqtt_");
+
+    KeyValueStorage target("target");
+    target.SetBackend(backend);
+    target.Load();
+    target.Set(String("mqtt_port"), 1u);
+    target.Set(String("other"), 2u);
+    assert(target.Import(snapshot.data(), snapshot.size()));
+    assert(target.GetKeyCount() == 3 && getString(target, "mqtt_host") == "broker");
+    assert(getValue(target, "mqtt_port") == 1883 && getValue(target, "other") == 2 && !target.IsSet(String("wifi_ssid")));
+
+    // the import is saved
+    KeyValueStorage reloaded("target");
+    reloaded.SetBackend(backend);
+    reloaded.Load();
+    assert(!reloaded.IsCorrupt() && reloaded.GetKeys() == target.GetKeys());
+
+    // without a prefix every key is exported
+    source.Export(snapshot);
+    KeyValueStorage copy("copy");
+    copy.SetBackend(backend);
+    copy.Load();
+    assert(copy.Import(snapshot.data(), snapshot.size(), false));
+    assert(copy.GetKeys() == source.GetKeys() && getString(copy, "wifi_ssid") == "home");
+}
+
+static void testRejected()
+{
+    RamBackend backend;
+    KeyValueStorage source("source");
+    source.SetBackend(backend);
+    source.Load();
+    setString(source, "mqtt_host", "broker");
+    source.Set(String("mqtt_port"), 1883u);
+    std::vector<uint8_t> snapshot;
+    source.Export(snapshot);
+
+    KeyValueStorage target("target");
+    target.SetBackend(backend);
+    target.Load();
+    target.Set(String("mqtt_port"), 1u);
+
+    // every byte is covered by the checksum
+    for (uint32_t i = 0; i < snapshot.size(); i++)
+    {
+        std::vector<uint8_t> corrupt = snapshot;
+        corrupt[i] ^= 0x10;
+        assert(!target.Import(corrupt.data(), corrupt.size()));
+    }
+    assert(!target.Import(snapshot.data(), snapshot.size() - 1));
+    assert(!target.Import(snapshot.data(), 0));
+    assert(target.GetKeyCount() == 1 && getValue(target, "mqtt_port") == 1);
+}
+
+static void testHiddenParameters()
+{
+    RamBackend backend;
+    ParameterSet params("params");
+    params.SetBackend(backend);
+    StringParameter host("host", "", params);
+    StringParameter password(".password", "", params);
+    host = "broker";
+    password = "secret";
+
+    // hidden parameters stay on the device
+    std::vector<uint8_t> snapshot;
+    params.Export(snapshot);
+    KeyValueStorage target("target");
+    target.SetBackend(backend);
+    target.Load();
+    assert(target.Import(snapshot.data(), snapshot.size(), false));
+    assert(target.GetKeyCount() == 1 && getString(target, "host") == "broker");
+}
+
+void setup()
+{
+    testPrefix();
+    testRejected();
+    testHiddenParameters();
+    Serial.println("ExportTest passed");
+}
@@ -0,0 +1,168 @@
+// The blob formats: a v1 blob of the first release loads and is saved again as v2, the front-coded
+// key table of v2 round-trips, and compressed blobs are read back while corrupted headers are rejected.
+#include <Esp32Foundation.h>
+#include <cassert>
+
+using namespace esp32::foundation;
+
+// written by the first release: key size, value size, null-terminated key and value of every entry
+static const uint8_t V1_BLOB[] = {
+    5, 0, 0, 0, 4, 0, 0, 0, 'n', 'a', 'm', 'e', 0, 'e', 's', 'p', 0,
+    5, 0, 0, 0, 4, 0, 0, 0, 'p', 'o', 'r', 't', 0, 0x5B, 0x07, 0, 0,
+    6, 0, 0, 0, 4, 0, 0, 0, 'r', 'a', 't', 'i', 'o', 0, 0, 0, 0, 0x3F};
+
+// the header of an encoded blob: marker 0, format and size of the entries
+static const uint32_t FORMAT_OFFSET = 4;
+static const uint32_t SIZE_OFFSET = 5;
+static const uint8_t VERSION_2 = 0x20;
+static const uint8_t COMPRESSED = 0x01;
+
+static std::vector<uint8_t> readBlob(RamBackend &backend, const char *name, const char *key)
+{
+    backend.Begin(name, true);
+    std::vector<uint8_t> blob(backend.GetSize(key));
+    backend.Read(key, blob.data(), blob.size());
+    backend.End();
+    return blob;
+}
+
+static void writeBlob(RamBackend &backend, const char *name, const char *key, const std::vector<uint8_t> &blob)
+{
+    backend.Begin(name, false);
+    backend.Write(key, blob.data(), blob.size());
+    backend.End();
+}
+
+static String getString(KeyValueStorage &storage, const String &key)
+{
+    std::vector<uint8_t> value;
+    assert(storage.Get(key, value) && !value.empty() && value.back() == 0);
+    return String((const char *)value.data());
+}
+
+static void checkV1Values(KeyValueStorage &storage, const uint32_t port)
+{
+    uint32_t portValue = 0;
+    float ratio = 0.0f;
+    assert(!storage.IsCorrupt() && storage.GetKeyCount() == 3);
+    assert(getString(storage, "name") == "esp");
+    assert(storage.Get(String("port"), portValue) && portValue == port);
+    assert(storage.Get(String("ratio"), ratio) && ratio == 0.5f);
+}
+
+static void testV1Blob()
+{
+    RamBackend backend;
+    backend.Begin("v1", false);
+    backend.WriteUInt("size", sizeof(V1_BLOB));
+    backend.Write("data", V1_BLOB, sizeof(V1_BLOB));
+    backend.End();
+
+    KeyValueStorage storage("v1");
+    storage.SetBackend(backend);
+    storage.Load();
+    checkV1Values(storage, 1883);
+
+    // the next save writes the current format
+    storage.Set(String("port"), 1884u);
+    storage.Save();
+    const std::vector<uint8_t> blob = readBlob(backend, "v1", "data");
+    assert(blob.size() > SIZE_OFFSET && blob[0] == 0 && blob[FORMAT_OFFSET] == VERSION_2);
+
+    KeyValueStorage reloaded("v1");
+    reloaded.SetBackend(backend);
+    reloaded.Load();
+    checkV1Values(reloaded, 1884);
+}
+
+static void testFrontCodedKeys()
+{
+    // keys that share prefixes of every length, a key that is the prefix of the next one and long keys
+    const std::vector<String> keys = {
+        "a", "ab", "abc", "abd", "b", "wifi_password", "wifi_ssid", "wifi_ssid_backup",
+        String(std::string(200, 'x')), String(std::string(201, 'x')), String(std::string(200, 'x') + "y")};
+
+    RamBackend backend;
+    KeyValueStorage storage("v2");
+    storage.SetBackend(backend);
+    storage.Load();
+    uint32_t rawSize = 0;
+    for (uint32_t i = 0; i < keys.size(); i++)
+    {
+        // inline and arena values
+        const String value = String("value of ") + keys[i].substring(0, 20) + (i % 2 == 0 ? "" : " which does not fit into the entry");
+        storage.Set(keys[i], value.c_str(), value.length() + 1);
+        rawSize += keys[i].length() + 1 + value.length() + 1;
+    }
+    storage.Save();
+
+    const std::vector<uint8_t> blob = readBlob(backend, "v2", "data");
+    assert(blob[0] == 0 && blob[FORMAT_OFFSET] == VERSION_2);
+    // the long keys are stored as suffixes of their predecessors
+    assert(blob.size() + 300 < rawSize);
+
+    KeyValueStorage reloaded("v2");
+    reloaded.SetBackend(backend);
+    reloaded.Load();
+    assert(!reloaded.IsCorrupt() && reloaded.GetKeys() == storage.GetKeys());
+    for (uint32_t i = 0; i < keys.size(); i++)
+    {
+        assert(getString(reloaded, keys[i]) == getString(storage, keys[i]));
+    }
+}
+
+static void testCompression()
+{
+    RamBackend backend;
+    KeyValueStorage storage("zip");
+    storage.SetBackend(backend);
+    storage.SetCompression(true);
+    storage.Load();
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        const String value = String("calibration value of sensor ") + i;
+        storage.Set(String("sensor_") + i, value.c_str(), value.length() + 1);
+    }
+    storage.Save();
+
+    const std::vector<uint8_t> blob = readBlob(backend, "zip", "data");
+    uint32_t size = 0;
+    memcpy(&size, blob.data() + SIZE_OFFSET, sizeof(size));
+    assert(blob[FORMAT_OFFSET] == (VERSION_2 | COMPRESSED) && blob.size() < size);
+
+    // compressed blobs are read regardless of the setting
+    KeyValueStorage reloaded("zip");
+    reloaded.SetBackend(backend);
+    reloaded.Load();
+    assert(!reloaded.IsCorrupt() && reloaded.GetKeyCount() == 100);
+    assert(getString(reloaded, "sensor_42") == "calibration value of sensor 42");
+
+    // a size that does not match the compressed entries, e.g. one that would exhaust the heap
+    for (const uint32_t corruptSize : {0x7FFFFFFFu, size + 1, size - 1})
+    {
+        std::vector<uint8_t> corrupt = blob;
+        memcpy(corrupt.data() + SIZE_OFFSET, &corruptSize, sizeof(corruptSize));
+        writeBlob(backend, "zip", "data", corrupt);
+        reloaded.Reload();
+        assert(reloaded.IsCorrupt() && reloaded.GetKeyCount() == 0);
+    }
+
+    // a format of a newer version
+    std::vector<uint8_t> newer = blob;
+    newer[FORMAT_OFFSET] = 0x30 | COMPRESSED;
+    writeBlob(backend, "zip", "data", newer);
+    reloaded.Reload();
+    assert(reloaded.IsCorrupt() && reloaded.GetKeyCount() == 0);
+
+    writeBlob(backend, "zip", "data", blob);
+    reloaded.Reload();
+    assert(!reloaded.IsCorrupt() && reloaded.GetKeyCount() == 100);
+}
+
+void setup()
+{
+    testV1Blob();
+    testFrontCodedKeys();
+    testCompression();
+    Serial.println("FormatTest passed");
+}
@@ -0,0 +1,84 @@
+// Key ids: an id returned by GetKeyId() stays with its key across Unset(), Clear() and Reload(),
+// while the ids of removed keys that were never handed out are reused.
+#include <Esp32Foundation.h>
+#include <cassert>
+
+using namespace esp32::foundation;
+
+static uint32_t getValue(KeyValueStorage &storage, const int32_t keyId)
+{
+    uint32_t value = 0;
+    assert(storage.Get(keyId, value));
+    return value;
+}
+
+static void testStableIds()
+{
+    RamBackend backend;
+    KeyValueStorage storage("ids");
+    storage.SetBackend(backend);
+    storage.Load();
+    storage.Set(String("a"), 1u);
+    storage.Set(String("b"), 2u);
+    storage.Set(String("c"), 3u);
+    const int32_t a = storage.GetKeyId(String("a"));
+    const int32_t b = storage.GetKeyId(String("b"));
+    const int32_t c = storage.GetKeyId(String("c"));
+    assert(a > -1 && b > -1 && c > -1 && a != b && b != c && a != c);
+
+    // a removed key is not set, setting its id sets the key again
+    storage.Unset(String("b"));
+    assert(storage.GetKeyId(String("b")) == -1 && !storage.IsSet(b));
+    assert(storage.Set(b, 20u) && storage.GetKeyId(String("b")) == b && getValue(storage, b) == 20);
+
+    // the keys set by name after Clear() get their previous ids
+    storage.Clear();
+    assert(storage.GetKeyCount() == 0 && !storage.IsSet(a) && storage.GetKeyId(String("a")) == -1);
+    storage.Set(String("c"), 30u);
+    storage.Set(String("a"), 10u);
+    assert(storage.GetKeyId(String("a")) == a && storage.GetKeyId(String("c")) == c);
+    storage.Save();
+
+    // a key written by another storage gets a new id, the known keys keep theirs
+    KeyValueStorage other("ids");
+    other.SetBackend(backend);
+    other.Load();
+    other.Set(String("d"), 4u);
+    other.Save();
+    storage.Reload();
+    const int32_t d = storage.GetKeyId(String("d"));
+    assert(d > -1 && d != a && d != b && d != c);
+    assert(getValue(storage, a) == 10 && !storage.IsSet(b) && getValue(storage, c) == 30 && getValue(storage, d) == 4);
+    assert(storage.Set(b, 21u) && storage.GetKeyId(String("b")) == b);
+}
+
+static void testReusedIds()
+{
+    RamBackend backend;
+    KeyValueStorage storage("ids");
+    storage.SetBackend(backend);
+    storage.Load();
+    storage.Set(String("kept"), 1u);
+    const int32_t kept = storage.GetKeyId(String("kept"));
+    storage.Unset(String("kept"));
+
+    // keys that come and go do not grow the index
+    for (uint32_t i = 0; i < 10000; i++)
+    {
+        const String key = String("temporary_") + i;
+        storage.Set(key, i);
+        storage.Unset(key);
+    }
+    storage.Set(String("new"), 2u);
+    assert(storage.GetKeyId(String("new")) < 100);
+
+    // unless their id was handed out
+    assert(storage.Set(kept, 3u) && storage.GetKeyId(String("kept")) == kept && getValue(storage, kept) == 3);
+}
+
+void setup()
+{
+    testStableIds();
+    testReusedIds();
+    Serial.println("IdTest passed");
+}
@@ -0,0 +1,119 @@
+// PM_LOG: the segments are replayed in order with their tombstones, and a compaction that is
+// interrupted at any write leaves either the previous or the new content readable, never a mix.
+#include <Esp32Foundation.h>
+#include <cassert>
+
+using namespace esp32::foundation;
+
+// fails every write of one key, e.g. to interrupt a save after the base blob was written
+class FailingBackend : public RamBackend
+{
+public:
+    String FailingKey;
+
+    virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override
+    {
+        return FailingKey == key ? 0 : RamBackend::Write(key, data, size);
+    }
+
+    virtual bool WriteUInt(const char *key, const uint32_t value) override
+    {
+        return FailingKey != key && RamBackend::WriteUInt(key, value);
+    }
+};
+
+static uint32_t getValue(KeyValueStorage &storage, const char *key)
+{
+    uint32_t value = 0;
+    assert(storage.Get(String(key), value));
+    return value;
+}
+
+static void createStorage(KeyValueStorage &storage, StorageBackend &backend)
+{
+    storage.SetBackend(backend);
+    // the compaction ratio is high enough that only the segment limit compacts the log
+    storage.SetPersistenceMode(PM_LOG, 1000.0f);
+    storage.Load();
+}
+
+static void testReplay()
+{
+    RamBackend backend;
+    KeyValueStorage storage("log");
+    createStorage(storage, backend);
+    storage.Set(String("k0"), 0u);
+    storage.Set(String("k1"), 1u);
+    storage.Set(String("k2"), 2u);
+    storage.Save();
+
+    storage.Set(String("k1"), 11u);
+    storage.Save();
+    storage.Unset(String("k2"));
+    storage.Save();
+    storage.Set(String("k2"), 22u);
+    storage.Unset(String("k0"));
+    storage.Save();
+
+    KeyValueStorage reloaded("log");
+    createStorage(reloaded, backend);
+    assert(!reloaded.IsCorrupt() && reloaded.GetKeyCount() == 2);
+    assert(!reloaded.IsSet(String("k0")) && getValue(reloaded, "k1") == 11 && getValue(reloaded, "k2") == 22);
+}
+
+static void testInterruptedCompaction(const char *failingKey)
+{
+    FailingBackend backend;
+    KeyValueStorage storage("log");
+    createStorage(storage, backend);
+    for (uint32_t round = 0; round < 3; round++)
+    {
+        storage.Set(String("k0"), round);
+        storage.Set(String("k2"), round);
+
+        // fills the log until the next save compacts it, every round starts without segments
+        for (uint32_t i = 0; i < 32; i++)
+        {
+            storage.Set(String("k1"), round * 100 + i);
+            storage.Save();
+        }
+        storage.Set(String("k0"), 1000u + round);
+        storage.Set(String("k1"), 1001u + round);
+        storage.Set(String("k2"), 1002u + round);
+
+        backend.FailingKey = failingKey;
+        storage.Save();
+        backend.FailingKey = "";
+
+        // the previous content with its whole log, or the compacted one
+        KeyValueStorage reloaded("log");
+        createStorage(reloaded, backend);
+        const uint32_t k0 = getValue(reloaded, "k0");
+        if (k0 == 1000 + round)
+        {
+            assert(getValue(reloaded, "k1") == 1001 + round && getValue(reloaded, "k2") == 1002 + round);
+        }
+        else
+        {
+            assert(!reloaded.IsCorrupt());
+            assert(k0 == round && getValue(reloaded, "k1") == round * 100 + 31 && getValue(reloaded, "k2") == round);
+        }
+
+        // the failed save is repeated by the next one
+        storage.Save();
+        KeyValueStorage saved("log");
+        createStorage(saved, backend);
+        assert(!saved.IsCorrupt());
+        assert(getValue(saved, "k0") == 1000 + round && getValue(saved, "k1") == 1001 + round && getValue(saved, "k2") == 1002 + round);
+    }
+}
+
+void setup()
+{
+    testReplay();
+    testInterruptedCompaction("logn");
+    testInterruptedCompaction("data");
+    testInterruptedCompaction("datb");
+    testInterruptedCompaction("crc");
+    Serial.println("LogTest passed");
+}
@@ -0,0 +1,102 @@
+// PM_SHARDED: a save only writes the shards of the modified keys, and a lazy reload reads a shard on
+// the first lookup of one of its keys without losing the unread shards on the next save.
+#include <Esp32Foundation.h>
+#include <cassert>
+
+using namespace esp32::foundation;
+
+static const uint32_t SHARD_COUNT = 4;
+static const uint32_t KEY_COUNT = 64;
+
+// counts the blobs written per key
+class CountingBackend : public RamBackend
+{
+public:
+    std::map<String, uint32_t> Writes;
+
+    virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override
+    {
+        Writes[key]++;
+        return RamBackend::Write(key, data, size);
+    }
+};
+
+static void createStorage(KeyValueStorage &storage, StorageBackend &backend, const bool lazy)
+{
+    storage.SetBackend(backend);
+    storage.SetPersistenceMode(PM_SHARDED);
+    storage.SetShardCount(SHARD_COUNT);
+    storage.SetLazyLoading(lazy);
+    storage.Load();
+}
+
+static uint32_t getValue(KeyValueStorage &storage, const uint32_t key)
+{
+    uint32_t value = 0;
+    assert(storage.Get(String("key_") + key, value));
+    return value;
+}
+
+// every key holds its number unless it was modified
+static void checkValues(KeyValueStorage &storage, const std::map<uint32_t, uint32_t> &modified)
+{
+    assert(!storage.IsCorrupt() && storage.GetKeyCount() == KEY_COUNT);
+    for (uint32_t key = 0; key < KEY_COUNT; key++)
+    {
+        auto it = modified.find(key);
+        assert(getValue(storage, key) == (it != modified.end() ? it->second : key));
+    }
+}
+
+void setup()
+{
+    CountingBackend backend;
+    KeyValueStorage storage("shards");
+    createStorage(storage, backend, false);
+    for (uint32_t key = 0; key < KEY_COUNT; key++)
+    {
+        storage.Set(String("key_") + key, key);
+    }
+    storage.Save();
+    for (uint32_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        assert(backend.Writes[String("s") + shard] == 1);
+    }
+    assert(backend.Writes["data"] == 0);
+
+    // only the shard of the modified key is written
+    backend.Writes.clear();
+    storage.Set(String("key_7"), 700u);
+    storage.Save();
+    uint32_t shardWrites = 0;
+    for (uint32_t shard = 0; shard < SHARD_COUNT; shard++)
+    {
+        shardWrites += backend.Writes[String("s") + shard];
+    }
+    assert(shardWrites == 1);
+
+    KeyValueStorage reloaded("shards");
+    createStorage(reloaded, backend, false);
+    assert(reloaded.GetPendingShardCount() == 0);
+    checkValues(reloaded, {{7, 700}});
+
+    // the lookup reads one shard, the key count all of them
+    KeyValueStorage lazy("shards");
+    createStorage(lazy, backend, true);
+    assert(lazy.GetPendingShardCount() == SHARD_COUNT);
+    assert(getValue(lazy, 7) == 700 && lazy.GetPendingShardCount() == SHARD_COUNT - 1);
+    checkValues(lazy, {{7, 700}});
+    assert(lazy.GetPendingShardCount() == 0 && !lazy.IsCorrupt());
+
+    // a save of a partially read storage keeps the shards it did not read
+    KeyValueStorage partial("shards");
+    createStorage(partial, backend, true);
+    partial.Set(String("key_9"), 900u);
+    assert(partial.GetPendingShardCount() > 0);
+    partial.Save();
+    KeyValueStorage saved("shards");
+    createStorage(saved, backend, false);
+    checkValues(saved, {{7, 700}, {9, 900}});
+
+    Serial.println("ShardTest passed");
+}
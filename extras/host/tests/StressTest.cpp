@@ -0,0 +1,163 @@
+// Several tasks read, write and save one storage and one parameter set at the same time,
+// every value read has to be one that was written. Build with -fsanitize=thread or address
+// to also catch the races that do not corrupt a value.
+#include <Esp32Foundation.h>
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+using namespace esp32::foundation;
+
+#define WRITER_COUNT 4
+#define READER_COUNT 4
+#define KEYS_PER_WRITER 16
+#define ROUNDS 2000
+
+// a value is valid if its check word matches, so a torn read is detected
+struct Value
+{
+    uint32_t Key;
+    uint32_t Round;
+    uint32_t Check;
+};
+
+static Value makeValue(const uint32_t key, const uint32_t round)
+{
+    return {key, round, (key * 2654435761u) ^ round};
+}
+
+static String keyName(const uint32_t key)
+{
+    return String("key_") + key;
+}
+
+static void testStorage()
+{
+    KeyValueStorage storage("stress");
+    storage.EnableLocking();
+    storage.Load();
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (uint32_t w = 0; w < WRITER_COUNT; w++)
+    {
+        threads.emplace_back([&storage, w]() {
+            for (uint32_t round = 1; round <= ROUNDS; round++)
+            {
+                if (round % 100 == 0)
+                {
+                    storage.Unset(keyName(w * KEYS_PER_WRITER));
+                }
+                for (uint32_t i = 0; i < KEYS_PER_WRITER; i++)
+                {
+                    const uint32_t key = w * KEYS_PER_WRITER + i;
+                    storage.Set(keyName(key), makeValue(key, round));
+                }
+            }
+        });
+    }
+
+    std::atomic<uint32_t> reads(0);
+    for (uint32_t r = 0; r < READER_COUNT; r++)
+    {
+        threads.emplace_back([&storage, &done, &reads, r]() {
+            uint32_t key = r;
+            while (!done)
+            {
+                key = (key + 7) % (WRITER_COUNT * KEYS_PER_WRITER);
+                Value value;
+                if (storage.Get(keyName(key), value))
+                {
+                    assert(value.Key == key && value.Check == makeValue(key, value.Round).Check);
+                    reads++;
+                }
+
+                std::vector<uint8_t> bytes;
+                if (storage.Get(storage.GetKeyId(keyName(key)), bytes))
+                {
+                    assert(bytes.size() == sizeof(Value));
+                }
+            }
+        });
+    }
+
+    std::thread saver([&storage, &done]() {
+        while (!done)
+        {
+            storage.Save();
+            delay(1);
+        }
+    });
+
+    for (uint32_t w = 0; w < WRITER_COUNT; w++)
+    {
+        threads[w].join();
+    }
+    done = true;
+    for (uint32_t i = WRITER_COUNT; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    saver.join();
+    storage.Save();
+
+    // the last round of every writer was persisted
+    KeyValueStorage reloaded("stress");
+    reloaded.Load();
+    for (uint32_t key = 0; key < WRITER_COUNT * KEYS_PER_WRITER; key++)
+    {
+        Value value;
+        assert(reloaded.Get(keyName(key), value));
+        assert(value.Key == key && value.Round == ROUNDS);
+    }
+    Serial.printf("storage: %u reads\n", (unsigned)reads);
+}
+
+static void testParameters()
+{
+    ParameterSet params("stressps");
+    params.EnableLocking();
+    IntegerParameter counter("counter", 0, 0, ROUNDS, params);
+    StringParameter text("text", "initial text", params);
+    params.EnableAutoSave(5, 50);
+
+    std::atomic<bool> done(false);
+    std::thread writer([&]() {
+        for (int32_t round = 1; round <= ROUNDS; round++)
+        {
+            counter = round;
+            text = String("text of round ") + round + ", long enough to live in the arena";
+        }
+        done = true;
+    });
+
+    std::thread reader([&]() {
+        int32_t last = 0;
+        while (!done)
+        {
+            const int32_t value = counter;
+            assert(value >= last && value <= ROUNDS);
+            last = value;
+
+            const String copy = text;
+            assert(copy == "initial text" || copy.startsWith("text of round "));
+        }
+    });
+
+    writer.join();
+    reader.join();
+    params.DisableAutoSave();
+    params.Flush();
+
+    ParameterSet reloaded("stressps");
+    IntegerParameter reloadedCounter("counter", 0, 0, ROUNDS, reloaded);
+    assert((int32_t)reloadedCounter == ROUNDS);
+}
+
+void setup()
+{
+    testStorage();
+    testParameters();
+    Serial.println("StressTest passed");
+}
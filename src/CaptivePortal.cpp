@@ -1,4 +1,5 @@
 #include "CaptivePortal.h"
+#include "HeapStats.h"
 #include <WiFi.h>
 #include <WiFiClient.h>
 #include <ESPmDNS.h>
@@ -21,6 +22,7 @@ namespace esp32
               _registerB(0),
               _registerC(0)
         {
+            HeapScope heapScope(HS_HTML);
             _apIP.fromString(ip);
             _callbacks["/"] = [](WebServer& sv)
             {
@@ -39,6 +41,7 @@ namespace esp32
                 const String& uri,
                 std::function<void(WebServer&)> callback)
         {
+            HeapScope heapScope(HS_HTML);
             _callbacks[uri] = callback;
         }
 
@@ -47,6 +50,7 @@ namespace esp32
             const String &wifiKey,
             const String &hostName)
         {
+            HeapScope heapScope(HS_HTML);
             Stop();
 
             _isStopped = false;
@@ -122,6 +126,7 @@ namespace esp32
 
         void CaptivePortal::Update()
         {
+            HeapScope heapScope(HS_HTML);
             if (!IsStopped())
             {
                 _dnsServer.processNextRequest();
@@ -0,0 +1,159 @@
+#include "Compression.h"
+#include <algorithm>
+#include <limits>
+
+#define HASH_BITS 8
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define EMPTY_POSITION 0xFFFFFFFF
+
+namespace esp32
+{
+    namespace foundation
+    {
+        void Compression::Compress(const uint8_t *data, const uint32_t size, std::vector<uint8_t> &result)
+        {
+            result.clear();
+            result.reserve(size + size / 255 + 16);
+
+            std::vector<uint32_t> table(1 << HASH_BITS, EMPTY_POSITION);
+
+            uint32_t anchor = 0;
+            uint32_t pos = 0;
+            while (pos + MIN_MATCH <= size)
+            {
+                uint32_t sequence;
+                memcpy(&sequence, data + pos, sizeof(sequence));
+                const uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+                const uint32_t candidate = table[hash];
+                table[hash] = pos;
+
+                if (candidate == EMPTY_POSITION || pos - candidate > MAX_OFFSET || memcmp(data + candidate, data + pos, MIN_MATCH) != 0)
+                {
+                    pos++;
+                    continue;
+                }
+
+                uint32_t matchLength = MIN_MATCH;
+                while (pos + matchLength < size && data[candidate + matchLength] == data[pos + matchLength])
+                {
+                    matchLength++;
+                }
+
+                // sequence: token, literal length, literals, offset, match length
+                const uint32_t literalLength = pos - anchor;
+                const uint32_t offset = pos - candidate;
+                result.push_back((std::min(literalLength, 15u) << 4) | std::min(matchLength - MIN_MATCH, 15u));
+                if (literalLength >= 15)
+                {
+                    WriteLength(result, literalLength - 15);
+                }
+                result.insert(result.end(), data + anchor, data + pos);
+                result.push_back(offset & 0xFF);
+                result.push_back(offset >> 8);
+                if (matchLength - MIN_MATCH >= 15)
+                {
+                    WriteLength(result, matchLength - MIN_MATCH - 15);
+                }
+
+                pos += matchLength;
+                anchor = pos;
+            }
+
+            // the last sequence only consists of literals
+            const uint32_t literalLength = size - anchor;
+            result.push_back(std::min(literalLength, 15u) << 4);
+            if (literalLength >= 15)
+            {
+                WriteLength(result, literalLength - 15);
+            }
+            result.insert(result.end(), data + anchor, data + size);
+        }
+
+        bool Compression::Decompress(const uint8_t *data, const uint32_t size, uint8_t *result, const uint32_t resultSize)
+        {
+            uint32_t idx = 0;
+            uint32_t pos = 0;
+            while (idx < size)
+            {
+                const uint8_t token = data[idx++];
+
+                uint32_t literalLength = token >> 4;
+                if (!ReadLength(data, size, idx, literalLength) ||
+                    literalLength > size - idx ||
+                    literalLength > resultSize - pos)
+                {
+                    return false;
+                }
+                memcpy(result + pos, data + idx, literalLength);
+                idx += literalLength;
+                pos += literalLength;
+
+                if (idx == size)
+                {
+                    break;
+                }
+
+                if (idx + 2 > size)
+                {
+                    return false;
+                }
+                const uint32_t offset = data[idx] | (data[idx + 1] << 8);
+                idx += 2;
+
+                uint32_t matchLength = token & 0x0F;
+                if (offset == 0 || offset > pos || !ReadLength(data, size, idx, matchLength))
+                {
+                    return false;
+                }
+                matchLength += MIN_MATCH;
+                if (matchLength > resultSize - pos)
+                {
+                    return false;
+                }
+
+                // byte by byte, the match may overlap the bytes it produces
+                for (uint32_t i = 0; i < matchLength; i++, pos++)
+                {
+                    result[pos] = result[pos - offset];
+                }
+            }
+            return pos == resultSize;
+        }
+
+        uint32_t Compression::GetMaxDecompressedSize(const uint32_t size)
+        {
+            // a length byte of 255 adds the most bytes, nothing else comes close
+            return (uint32_t)std::min<uint64_t>((uint64_t)size * 255, std::numeric_limits<uint32_t>::max());
+        }
+
+        void Compression::WriteLength(std::vector<uint8_t> &result, uint32_t length)
+        {
+            while (length >= 255)
+            {
+                result.push_back(255);
+                length -= 255;
+            }
+            result.push_back(length);
+        }
+
+        bool Compression::ReadLength(const uint8_t *data, const uint32_t size, uint32_t &idx, uint32_t &length)
+        {
+            // a nibble of 15 is continued by bytes until one is below 255
+            if (length == 15)
+            {
+                uint8_t value;
+                do
+                {
+                    if (idx >= size)
+                    {
+                        return false;
+                    }
+                    value = data[idx++];
+                    length += value;
+                } while (value == 255);
+            }
+            return true;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+
+namespace esp32
+{
+    namespace foundation
+    {
+        // LZ77 codec in the style of the LZ4 block format. The compressor needs a 1 KB
+        // hash table, the decompressor works in place of the output buffer without extra memory.
+        class Compression
+        {
+        public:
+            static void Compress(
+                const uint8_t *data,
+                const uint32_t size,
+                std::vector<uint8_t> &result);
+
+            // result must have room for exactly resultSize bytes
+            static bool Decompress(
+                const uint8_t *data,
+                const uint32_t size,
+                uint8_t *result,
+                const uint32_t resultSize);
+
+            // upper bound of the bytes that size compressed bytes can decompress to
+            static uint32_t GetMaxDecompressedSize(const uint32_t size);
+
+        private:
+            static void WriteLength(std::vector<uint8_t> &result, uint32_t length);
+            static bool ReadLength(const uint8_t *data, const uint32_t size, uint32_t &idx, uint32_t &length);
+        };
+    }
+}
@@ -1,8 +1,12 @@
 #pragma once
+#include "Compression.h"
+#include "HeapStats.h"
 #include "KeyValueStorage.h"
 #include "ParameterSet.h"
 #include "SerialCLI.h"
 #include "StringUtils.h"
+#include "StorageBackend.h"
+#include "StorageManager.h"
 #include "CaptivePortal.h"
 #include "HtmlConfigurator.h"
 #include "WiFiSmartClient.h"
\ No newline at end of file
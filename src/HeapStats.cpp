@@ -0,0 +1,302 @@
+#include "HeapStats.h"
+#include <atomic>
+#include <cinttypes>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// keeps the alignment that operator new guarantees for the memory behind the header
+#define ALLOCATION_HEADER_SIZE (__STDCPP_DEFAULT_NEW_ALIGNMENT__ > 8 ? __STDCPP_DEFAULT_NEW_ALIGNMENT__ : 8)
+// marks the blocks with a header, blocks which did not pass the wrappers, e.g. of a shared library, have none
+#define ALLOCATION_TAG 0x48537400u
+
+#ifdef ESP32_FOUNDATION_HEAP_STATS
+// the allocator behind the -Wl,--wrap linker flags
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+extern "C" void __real_free(void *ptr);
+#endif
+
+namespace esp32
+{
+    namespace foundation
+    {
+#ifdef ESP32_FOUNDATION_HEAP_STATS
+        struct HeapCounters
+        {
+            std::atomic<uint32_t> Allocations;
+            std::atomic<uint32_t> Frees;
+            std::atomic<uint32_t> Bytes;
+            std::atomic<uint32_t> PeakBytes;
+        };
+
+        // zero initialized before any constructor runs, so static objects may allocate
+        static HeapCounters heapCounters[HS_COUNT];
+        static thread_local HeapSubsystem currentSubsystem = HS_OTHER;
+
+        // right in front of the memory handed out, Tag is ALLOCATION_TAG plus the subsystem
+        struct AllocationHeader
+        {
+            uint32_t Size;
+            uint32_t Tag;
+        };
+
+        static AllocationHeader *GetHeader(void *ptr)
+        {
+            AllocationHeader *header = (AllocationHeader *)((uint8_t *)ptr - ALLOCATION_HEADER_SIZE);
+            return header->Tag - ALLOCATION_TAG < HS_COUNT ? header : nullptr;
+        }
+
+        static void CountAllocation(AllocationHeader *header, const size_t size)
+        {
+            const HeapSubsystem subsystem = currentSubsystem;
+            header->Size = size;
+            header->Tag = ALLOCATION_TAG + subsystem;
+
+            HeapCounters &counters = heapCounters[subsystem];
+            counters.Allocations++;
+            const uint32_t bytes = counters.Bytes += size;
+            uint32_t peak = counters.PeakBytes;
+            while (bytes > peak && !counters.PeakBytes.compare_exchange_weak(peak, bytes))
+            {
+            }
+        }
+
+        static void CountFree(AllocationHeader *header)
+        {
+            HeapCounters &counters = heapCounters[header->Tag - ALLOCATION_TAG];
+            counters.Frees++;
+            counters.Bytes -= header->Size;
+            header->Tag = 0;
+        }
+
+        static void *Allocate(const size_t size)
+        {
+            uint8_t *block = (uint8_t *)__real_malloc(ALLOCATION_HEADER_SIZE + size);
+            if (block == nullptr)
+            {
+                return nullptr;
+            }
+            CountAllocation((AllocationHeader *)block, size);
+            return block + ALLOCATION_HEADER_SIZE;
+        }
+
+        static void *Reallocate(void *ptr, const size_t size)
+        {
+            if (ptr == nullptr)
+            {
+                return Allocate(size);
+            }
+
+            AllocationHeader *header = GetHeader(ptr);
+            if (header == nullptr)
+            {
+                return __real_realloc(ptr, size);
+            }
+
+            // counted as a free and an allocation, the header moves with the block
+            uint8_t *block = (uint8_t *)__real_realloc(header, ALLOCATION_HEADER_SIZE + size);
+            if (block == nullptr)
+            {
+                return nullptr;
+            }
+            CountFree((AllocationHeader *)block);
+            CountAllocation((AllocationHeader *)block, size);
+            return block + ALLOCATION_HEADER_SIZE;
+        }
+
+        static void Free(void *ptr)
+        {
+            if (ptr == nullptr)
+            {
+                return;
+            }
+
+            AllocationHeader *header = GetHeader(ptr);
+            if (header == nullptr)
+            {
+                __real_free(ptr);
+                return;
+            }
+            CountFree(header);
+            __real_free(header);
+        }
+
+        HeapScope::HeapScope(const HeapSubsystem subsystem) :
+            _previous(currentSubsystem)
+        {
+            currentSubsystem = subsystem;
+        }
+
+        HeapScope::~HeapScope()
+        {
+            currentSubsystem = _previous;
+        }
+
+        bool HeapStats::IsEnabled()
+        {
+            return true;
+        }
+
+        HeapUsage HeapStats::GetUsage(const HeapSubsystem subsystem)
+        {
+            const HeapCounters &counters = heapCounters[subsystem];
+            return {counters.Allocations, counters.Frees, counters.Bytes, counters.PeakBytes};
+        }
+
+        void HeapStats::ResetPeaks()
+        {
+            for (auto &counters : heapCounters)
+            {
+                counters.PeakBytes = counters.Bytes.load();
+            }
+        }
+#else
+        bool HeapStats::IsEnabled()
+        {
+            return false;
+        }
+
+        HeapUsage HeapStats::GetUsage(const HeapSubsystem subsystem)
+        {
+            return {0, 0, 0, 0};
+        }
+
+        void HeapStats::ResetPeaks()
+        {
+        }
+#endif
+
+        const char *HeapStats::GetName(const HeapSubsystem subsystem)
+        {
+            switch (subsystem)
+            {
+                case HS_KEY_VALUE_STORAGE:
+                    return "storage";
+                case HS_PARAMETER_SET:
+                    return "parameters";
+                case HS_SERIAL_CLI:
+                    return "cli";
+                case HS_HTML:
+                    return "html";
+                case HS_WIFI_CLIENT:
+                    return "wifi";
+                default:
+                    return "other";
+            }
+        }
+
+        void HeapStats::Print(HardwareSerial &serial)
+        {
+            if (!IsEnabled())
+            {
+                serial.println(F("heap stats: build with -D ESP32_FOUNDATION_HEAP_STATS"));
+            }
+            else
+            {
+                for (uint32_t i = 0; i < HS_COUNT; i++)
+                {
+                    const HeapUsage usage = GetUsage((HeapSubsystem)i);
+                    serial.printf(
+                        "%-10s allocs: %" PRIu32 ", frees: %" PRIu32 ", bytes: %" PRIu32 ", peak: %" PRIu32 "\n",
+                        GetName((HeapSubsystem)i),
+                        usage.Allocations,
+                        usage.Frees,
+                        usage.Bytes,
+                        usage.PeakBytes);
+                }
+            }
+            serial.printf("free heap: %" PRIu32 ", largest free block: %" PRIu32 "\n", ESP.getFreeHeap(), ESP.getMaxAllocHeap());
+        }
+    }
+}
+
+#ifdef ESP32_FOUNDATION_HEAP_STATS
+// called instead of malloc(), realloc(), calloc() and free() with the linker flags
+// -Wl,--wrap=malloc,--wrap=realloc,--wrap=calloc,--wrap=free, e.g. by Arduino Strings
+extern "C" void *__wrap_malloc(size_t size)
+{
+    return esp32::foundation::Allocate(size);
+}
+
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+    return esp32::foundation::Reallocate(ptr, size);
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+    {
+        return nullptr;
+    }
+    void *ptr = esp32::foundation::Allocate(count * size);
+    if (ptr != nullptr)
+    {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+extern "C" void __wrap_free(void *ptr)
+{
+    esp32::foundation::Free(ptr);
+}
+
+// replaces the global allocation functions, the aligned variants keep their default implementation
+void *operator new(size_t size)
+{
+    void *ptr = esp32::foundation::Allocate(size);
+    if (ptr == nullptr)
+    {
+        abort();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return esp32::foundation::Allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return esp32::foundation::Allocate(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    esp32::foundation::Free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    esp32::foundation::Free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    esp32::foundation::Free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    esp32::foundation::Free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    esp32::foundation::Free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    esp32::foundation::Free(ptr);
+}
+#endif
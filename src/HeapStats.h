@@ -0,0 +1,60 @@
+#pragma once
+#include <Arduino.h>
+
+namespace esp32
+{
+    namespace foundation
+    {
+        enum HeapSubsystem
+        {
+            HS_OTHER = 0,          // everything outside of a HeapScope, e.g. the sketch
+            HS_KEY_VALUE_STORAGE,
+            HS_PARAMETER_SET,
+            HS_SERIAL_CLI,
+            HS_HTML,               // HtmlTemplates, HtmlConfigurator and CaptivePortal
+            HS_WIFI_CLIENT,
+            HS_COUNT
+        };
+
+        // Bytes is what is currently allocated, PeakBytes the maximum of it since the last ResetPeaks()
+        struct HeapUsage
+        {
+            uint32_t Allocations;
+            uint32_t Frees;
+            uint32_t Bytes;
+            uint32_t PeakBytes;
+        };
+
+        // Counts the allocations by operator new and malloc() per subsystem, the subsystem of an allocation is
+        // the one of the innermost HeapScope of the allocating task. Only compiled in with the build flag
+        // -D ESP32_FOUNDATION_HEAP_STATS, which adds 8 bytes to every allocation and requires the linker flags
+        // -Wl,--wrap=malloc,--wrap=realloc,--wrap=calloc,--wrap=free, so the buffers of Arduino Strings are included.
+        // Memory allocated by heap_caps_malloc() is not counted, blocks of malloc() must not be passed to heap_caps_free().
+        class HeapStats
+        {
+        public:
+            static bool IsEnabled();
+            static HeapUsage GetUsage(const HeapSubsystem subsystem);
+            static const char *GetName(const HeapSubsystem subsystem);
+            static void ResetPeaks();
+
+            // one line per subsystem followed by the free heap and its largest free block
+            static void Print(HardwareSerial &serial);
+        };
+
+        // attributes the allocations of the current task to a subsystem until it goes out of scope
+        class HeapScope
+        {
+        public:
+#ifdef ESP32_FOUNDATION_HEAP_STATS
+            HeapScope(const HeapSubsystem subsystem);
+            ~HeapScope();
+
+        private:
+            HeapSubsystem _previous;
+#else
+            HeapScope(const HeapSubsystem subsystem) {}
+#endif
+        };
+    }
+}
@@ -1,4 +1,5 @@
 #include "HtmlConfigurator.h"
+#include "StringUtils.h"
 #include "html/ConfigCompleted.html"
 #include "html/ConfigCanceled.html"
 namespace esp32
@@ -83,6 +84,13 @@ namespace esp32
                     postParams[sv.argName(i)] = sv.arg(i);
                 }
 
+                // the form is applied as a whole, a transaction opened by another caller of this task
+                // (e.g. the serial CLI) would take the writes of the form otherwise
+                if (!_paramSet.BeginTransaction())
+                {
+                    sv.send(409, "text/plain", "another transaction is open, try again later");
+                    return;
+                }
                 for (auto &param : _paramSet.GetParameters())
                 {
                     auto it = postParams.find(param.first);
@@ -91,6 +99,11 @@ namespace esp32
                         param.second->SetFromString(it->second);
                     }
                 }
+                if (!_paramSet.Commit())
+                {
+                    sv.send(500, "text/plain", "the parameters could not be applied");
+                    return;
+                }
 
                 sv.setContentLength(CONTENT_LENGTH_UNKNOWN);
                 sv.send(200, "text/html", "");                
@@ -100,6 +113,50 @@ namespace esp32
                 delay(2000);
                 _onApply(_paramSet);
             });
+
+            On("/telemetry", [&](WebServer &sv)
+            {
+                sv.send(200, "text/plain", _paramSet.FormatTelemetry());
+            });
+
+            // the parameters as base64 text, /export?prefix=mqtt_ restricts them to the keys with the prefix
+            On("/export", [&](WebServer &sv)
+            {
+                if (!IsProvisioningAllowed(sv))
+                {
+                    return;
+                }
+
+                std::vector<uint8_t> data;
+                _paramSet.Export(data, sv.arg("prefix"));
+                sv.send(200, "text/plain", StringUtils::ToBase64(data.data(), data.size()));
+            });
+
+            // takes the text of /export as the form field "snapshot" or as the request body
+            On("/import", [&](WebServer &sv)
+            {
+                if (!IsProvisioningAllowed(sv))
+                {
+                    return;
+                }
+                if (_paramSet.IsInTransaction())
+                {
+                    // the import would only be staged in it, Import() does not save it then
+                    sv.send(409, "text/plain", "another transaction is open, try again later");
+                    return;
+                }
+
+                std::vector<uint8_t> data;
+                const String text = sv.hasArg("snapshot") ? sv.arg("snapshot") : sv.arg("plain");
+                if (StringUtils::FromBase64(text, data) && _paramSet.Import(data.data(), data.size()))
+                {
+                    sv.send(200, "text/plain", "imported");
+                }
+                else
+                {
+                    sv.send(400, "text/plain", "invalid snapshot");
+                }
+            });
         }
 
         HtmlConfigurator::~HtmlConfigurator()
@@ -115,5 +172,33 @@ namespace esp32
         {
             _onApply = callback;
         }
+
+        void HtmlConfigurator::EnableProvisioning(const String& token)
+        {
+            _provisioningToken = token;
+        }
+
+        bool HtmlConfigurator::IsProvisioningAllowed(WebServer &sv) const
+        {
+            if (_provisioningToken.isEmpty())
+            {
+                sv.send(404, "text/plain", "provisioning is disabled");
+                return false;
+            }
+
+            // compares every character, so the time does not tell how much of the token matched
+            const String token = sv.arg("token");
+            uint8_t diff = token.length() != _provisioningToken.length();
+            for (uint32_t i = 0; i < token.length(); i++)
+            {
+                diff |= token[i] ^ _provisioningToken[i % _provisioningToken.length()];
+            }
+            if (diff != 0)
+            {
+                sv.send(403, "text/plain", "invalid token");
+                return false;
+            }
+            return true;
+        }
     }
 }
\ No newline at end of file
@@ -19,8 +19,15 @@ namespace esp32
             void OnCancel(std::function<void(void)> callback);
             void OnApply(std::function<void(ParameterSet&)> callback);
 
+            // /export and /import are disabled until a token is set, their requests must pass it as
+            // the argument "token", e.g. /export?token=...&prefix=mqtt_
+            void EnableProvisioning(const String& token);
+
         private:
+            bool IsProvisioningAllowed(WebServer &sv) const;
+
             ParameterSet& _paramSet;
+            String _provisioningToken;
             std::function<void(void)> _onCancel;
             std::function<void(ParameterSet&)> _onApply;
         };
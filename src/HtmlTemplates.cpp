@@ -1,4 +1,5 @@
 #include "HtmlTemplates.h"
+#include "HeapStats.h"
 #include <sstream>
 
 namespace esp32
@@ -7,8 +8,9 @@ namespace esp32
     {
         String HtmlTemplates::HtmlSpecialChars(const String &str)
         {
+            HeapScope heapScope(HS_HTML);
             String result;
-            for (int i = 0; i < str.length(); i++)
+            for (uint32_t i = 0; i < str.length(); i++)
             {
                 char c = str[i];
                 if (c == '<')
@@ -31,6 +33,7 @@ namespace esp32
             const String &value, 
             const bool password)
         {
+            HeapScope heapScope(HS_HTML);
             const String _id = HtmlSpecialChars(id);
             String result;
             result += "<div class=\"form-group\">";
@@ -46,6 +49,7 @@ namespace esp32
                 const String &label, 
                 const bool &checked)
         {
+            HeapScope heapScope(HS_HTML);
             const String _id = HtmlSpecialChars(id);
             String result;
             result += R"(<div class="form-check" style="margin-bottom: 10px">)";
@@ -68,6 +72,7 @@ namespace esp32
             const String &minValue, 
             const String &maxValue)
         {
+            HeapScope heapScope(HS_HTML);
             const String _id = HtmlSpecialChars(id);
             String result;
             result += "<div class=\"form-group\">";
@@ -89,6 +94,7 @@ namespace esp32
             Parameter& p,
             const String &label)
         {
+            HeapScope heapScope(HS_HTML);
             String s;
             switch (p.Type)
             {
@@ -1,254 +1,2557 @@
 #include "KeyValueStorage.h"
+#include "Compression.h"
+#include "HeapStats.h"
+#include <freertos/task.h>
 #include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+
+#define MAX_LOG_SEGMENTS 32
+#define MAX_SHARDS 64
+#define MIN_ARENA_GARBAGE 256
+#define MIN_COMPRESSION_SIZE 64
+#define BLOB_COMPRESSED 0x01
+#define BLOB_CHUNKED 0x02
+#define BLOB_CHUNK_SET 0x04
+#define BLOB_VERSION_MASK 0xF0
+#define BLOB_VERSION_2 0x20
+#define ALL_SHARDS 0xFFFFFFFF
+#define CHUNK_SIZE 1024
+#define MAX_BUFFERED_BLOB_SIZE 2048
+#define EMPTY_SLOT -1
+#define EXPORT_MARKER 0x5053564B // "KVSP"
+#define LOG_SECOND_BASE 0x80000000
 
 namespace esp32
 {
     namespace foundation
     {
+        ValueView::ValueView() :
+            _data(nullptr),
+            _size(0),
+            _storage(nullptr),
+            _generation(0)
+        {
+        }
+
+        const uint8_t *ValueView::Data() const
+        {
+            assert(IsValid());
+            return _data;
+        }
+
+        uint32_t ValueView::Size() const
+        {
+            return _size;
+        }
+
+        bool ValueView::IsValid() const
+        {
+            return _storage != nullptr && _storage->GetGeneration() == _generation;
+        }
+
+        void LatencyHistogram::Add(const uint32_t duration)
+        {
+            uint32_t bucket = 0;
+            while (bucket < BucketCount - 1 && duration >= (1000u << bucket))
+            {
+                bucket++;
+            }
+            Buckets[bucket]++;
+            Count++;
+            MaxMicros = std::max(MaxMicros, duration);
+            TotalMicros += duration;
+        }
+
+        uint32_t LatencyHistogram::GetAverageMicros() const
+        {
+            return Count > 0 ? TotalMicros / Count : 0;
+        }
+
         KeyValueStorage::KeyValueStorage(const String& name) : 
             _name(name),
+            _backend(&_preferences),
             _isLoaded(false),
             _isModified(false),
-            _maxKeyId(-1)
+            _dataMutex(nullptr),
+            _saveMutex(nullptr),
+            _readersDone(nullptr),
+            _readers(0),
+            _garbage(0),
+            _generation(0),
+            _contentHash(0),
+            _persistedHash(0),
+            _isPersistedHashValid(false),
+            _isCorrupt(false),
+            _skippedSaves(0),
+            _telemetry(),
+            _savePrepareMicros(0),
+            _countKeyWrites(false),
+            _mode(PM_SNAPSHOT),
+            _compactionRatio(1.0f),
+            _rewritePending(false),
+            _compression(false),
+            _logSegments(0),
+            _logSize(0),
+            _secondBase(false),
+            _shardCount(8),
+            _persistedShards(0),
+            _lazyLoading(false),
+            _pendingShardCount(0),
+            _inTransaction(false),
+            _transactionFailed(false),
+            _transactionOwner(nullptr)
         {
+            _telemetry.StartMillis = millis();
         }
 
         KeyValueStorage::~KeyValueStorage()
         {
+            if (_dataMutex != nullptr)
+            {
+                vSemaphoreDelete(_dataMutex);
+                vSemaphoreDelete(_saveMutex);
+                vSemaphoreDelete(_readersDone);
+            }
         }
 
         bool KeyValueStorage::Load()
         {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
             if (!IsLoaded())
             {
-                Reload();
-                return true;
+                // check again with the locks held, another task may have loaded it in the meantime
+                const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+                ScopedLock lock(*this);
+                const bool load = !IsLoaded();
+                if (load)
+                {
+                    Reload();
+                }
+                GiveMutex(saveMutex);
+                return load;
             }
             return false;
         }
 
         uint32_t KeyValueStorage::Reload()
         {
-            _maxKeyId = -1;
-            _values.clear();
-            _keys.clear();
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+            ScopedLock lock(*this);
+            const uint32_t start = micros();
+
+            RemoveAllEntries();
+            _generation++;
+
+            SetLogCounter(0);
+            _persistedShards = 0;
+            _dirtyShards.assign(_shardCount, false);
+            _pendingShards.clear();
+            _pendingShardCount = 0;
 
-            std::vector<uint8_t> buffer;            
-            if (_pref.begin(_name.c_str(), true))
+            // the blobs are read straight into the arena and indexed in place,
+            // so the entries are neither copied nor looked up by a String
+            bool hasBaseBlob = false;
+            bool lazy = false;
+            bool hasStoredHash = false;
+            uint32_t storedHash = 0;
+            if (_backend->Begin(_name.c_str(), true))
             {
-                const uint32_t size = _pref.getUInt("size", 0);
-                buffer.resize(size);
-                if (size > 0)
+                hasStoredHash = _backend->Exists("crc");
+                storedHash = _backend->ReadUInt("crc", 0);
+
+                // apply the log segments on top of the base blob in the order they were written
+                SetLogCounter(_backend->ReadUInt("logn", 0));
+                hasBaseBlob = ReadBlob(GetBaseName()) > 0;
+                for (uint32_t i = 0; i < _logSegments; i++)
+                {
+                    const String segment = String("log") + i;
+                    _logSize += ReadBlob(segment.c_str());
+                }
+
+                // the shards are only read once one of their keys is looked up, this requires
+                // the checksum, which is then verified as soon as all shards were read
+                _persistedShards = _backend->ReadUInt("shards", 0);
+                lazy = _lazyLoading && hasStoredHash && !hasBaseBlob && _logSegments == 0 &&
+                       _mode == PM_SHARDED && _persistedShards == _shardCount;
+                if (lazy)
                 {
-                    _pref.getBytes("data", buffer.data(), buffer.size());
+                    _pendingShards.assign(_persistedShards, true);
+                    _pendingShardCount = _persistedShards;
                 }
-                _pref.end();
+                else
+                {
+                    for (uint32_t i = 0; i < _persistedShards; i++)
+                    {
+                        const String shard = String("s") + i;
+                        ReadBlob(shard.c_str());
+                    }
+                }
+                _backend->End();
             }
+            CompactArena();
 
-            uint8_t *buff = buffer.data();
-            uint8_t *ptr = buff;
-            const uint8_t *endPtr = buff + buffer.size();
-            while (ptr < endPtr)
-            {
-                const EntryHeader* entry = (EntryHeader*)ptr;
-                ptr += sizeof(EntryHeader);
+            // blobs written before the checksum was introduced are accepted as they are
+            _contentHash = lazy ? storedHash : ComputeContentHash();
+            _isCorrupt = hasStoredHash && storedHash != _contentHash;
+            _persistedHash = _contentHash;
+            _isPersistedHashValid = !_isCorrupt;
 
-                if (ptr > endPtr) break;
+            _dirtyKeyIds.clear();
+            _removedKeys.clear();
+            _dirtyShards.assign(_shardCount, false);
 
-                // check null terminatin of key
-                if (entry->keySize == 0 || ptr[entry->keySize - 1] != 0) break;
+            // incremental saves are only possible if the persisted layout matches the mode
+            _rewritePending =
+                _isCorrupt ||
+                (_mode == PM_LOG && _persistedShards > 0) ||
+                (_mode == PM_SHARDED && (_persistedShards != _shardCount || hasBaseBlob || _logSegments > 0));
+            _isModified = false;
+            _isLoaded = true;
 
-                const String key = (char *)ptr;
-                ptr += entry->keySize;
+            _telemetry.ReloadCount++;
+            _telemetry.ReloadLatency.Add(micros() - start);
+            GiveMutex(saveMutex);
+            return _sortedKeys.size();
+        }
+
+        void KeyValueStorage::Save()
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            // the flash is written outside of the data lock, so the storage stays
+            // readable (and writable) while a save is in progress
+            const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
 
-                if (ptr > endPtr) break;
+            std::vector<PendingWrite> writes;
+            BeginSave(writes);
+            EndSave(writes);
+
+            GiveMutex(saveMutex);
+        }
+
+        void KeyValueStorage::BeginSave(std::vector<PendingWrite> &writes)
+        {
+            // the writes hold copies of everything they write, so the flash is written without a lock
+            const uint32_t start = micros();
+            PrepareSave(writes);
+            _savePrepareMicros = micros() - start;
+        }
 
-                const uint8_t *value = (uint8_t *)ptr;
-                ptr += entry->valueSize;
+        bool KeyValueStorage::EndSave(std::vector<PendingWrite> &writes)
+        {
+            const uint32_t start = micros();
+            const bool success = writes.empty() || CommitWrites(writes);
 
-                if (ptr > endPtr) break;
+            if (!writes.empty())
+            {
+                (success ? _telemetry.SaveCount : _telemetry.FailedSaveCount)++;
+                _telemetry.SaveLatency.Add(_savePrepareMicros + micros() - start);
+            }
 
-                if (entry->keySize > 0 && entry->valueSize > 0)
+            if (!success)
+            {
+                // the persisted state is unknown now, so the next save rewrites everything,
+                // the log counter tells it which base blob it must not overwrite
+                uint32_t counter = GetLogCounter();
+                if (_backend->Begin(_name.c_str(), true))
                 {
-                    Set(key, value, entry->valueSize);
+                    counter = _backend->ReadUInt("logn", 0);
+                    _backend->End();
                 }
+
+                ScopedLock lock(*this);
+                SetLogCounter(counter);
+                _isModified = true;
+                _rewritePending = true;
+                _isPersistedHashValid = false;
+                return false;
             }
+            return true;
+        }
 
+        void KeyValueStorage::PrepareSave(std::vector<PendingWrite> &writes)
+        {
+            ScopedLock lock(*this);
+            if (!_isModified)
+            {
+                return;
+            }
             _isModified = false;
-            _isLoaded = true;
 
-            return _values.size();
+            if (_isPersistedHashValid && !_rewritePending && _contentHash == _persistedHash)
+            {
+                // e.g. a value was changed and changed back
+                _skippedSaves++;
+            }
+            else
+            {
+                if (_rewritePending)
+                {
+                    // every shard is going to be rewritten
+                    LoadPendingShards();
+                }
+
+                if (_mode == PM_LOG && !_rewritePending)
+                {
+                    PrepareLogSegment(writes);
+                }
+                else if (_mode == PM_SHARDED)
+                {
+                    PrepareShards(writes);
+                }
+                else
+                {
+                    PrepareSnapshot(writes);
+                }
+
+                QueueUInt(writes, "crc", _contentHash);
+                _persistedHash = _contentHash;
+                _isPersistedHashValid = true;
+            }
+
+            _dirtyKeyIds.clear();
+            _removedKeys.clear();
+            _dirtyShards.assign(_shardCount, false);
+            _rewritePending = false;
         }
 
-        void KeyValueStorage::Save()
+        bool KeyValueStorage::CommitWrites(std::vector<PendingWrite> &writes)
         {
-            if (_isModified && _pref.begin(_name.c_str(), false))
+            if (!_backend->Begin(_name.c_str(), false))
             {
-                _isModified = false;
+                return false;
+            }
 
-                std::vector<uint8_t> buffer;
-                buffer.reserve(512);
-                for (auto &key : _keys)
+            // stops at the first failure, so e.g. a log counter is never updated for a missing segment
+            bool success = true;
+            for (auto &write : writes)
+            {
+                switch (write.Type)
                 {
-                    const auto &value = _values.at(key.second);
-                    if (value.empty())
-                    {
-                        continue;
-                    }
-
-                    EntryHeader entry;
-                    entry.keySize = key.first.length() + 1;
-                    entry.valueSize = value.size();
+                    case WT_BYTES:
+                        success = _backend->Write(write.Key.c_str(), write.Data.data(), write.Data.size()) == write.Data.size();
+                        if (success)
+                        {
+                            CountWrite(write.Data.size());
+                            RemoveChunks(write.Key, false, 0);
+                            RemoveChunks(write.Key, true, 0);
+                        }
+                        break;
+                    case WT_UINT:
+                        success = _backend->WriteUInt(write.Key.c_str(), write.Value);
+                        if (success)
+                        {
+                            CountWrite(sizeof(uint32_t));
+                        }
+                        break;
+                    case WT_REMOVE:
+                        // removing a key that does not exist is no error
+                        _backend->Remove(write.Key.c_str());
+                        RemoveChunks(write.Key, false, 0);
+                        RemoveChunks(write.Key, true, 0);
+                        break;
+                    case WT_STREAM:
+                        success = StreamBlob(write.Key, write.Chunks, write.Value);
+                        break;
+                }
 
-                    uint32_t idx = buffer.size();
-                    buffer.resize(buffer.size() + sizeof(EntryHeader) + entry.keySize + entry.valueSize);
-                    memcpy(&buffer[idx], &entry, sizeof(EntryHeader));
-                    idx += sizeof(EntryHeader);
-                    memcpy(&buffer[idx], key.first.c_str(), entry.keySize);
-                    idx += entry.keySize;
-                    memcpy(&buffer[idx], value.data(), entry.valueSize);
-                    idx += entry.valueSize;
+                if (!success)
+                {
+                    break;
                 }
+            }
 
-                _pref.putUInt("size", (uint32_t)buffer.size());
-                _pref.putBytes("data", buffer.data(), buffer.size());
+            _backend->End();
+            return success;
+        }
 
-                _pref.end();
-            }
+        void KeyValueStorage::CountWrite(const uint32_t size)
+        {
+            _telemetry.FlashWriteCount++;
+            _telemetry.BytesWritten += size;
         }
 
-        void KeyValueStorage::Clear()
+        void KeyValueStorage::QueueBytes(std::vector<PendingWrite> &writes, const String &key, std::vector<uint8_t> &data)
         {
-            if (!_keys.empty())
+            if (data.empty())
             {
-                _isModified = true;
-                _keys.clear();
-                _values.clear();
+                // Preferences refuses to write empty blobs, the other backends are treated alike
+                QueueRemove(writes, key);
+                return;
             }
+
+            PendingWrite write;
+            write.Type = WT_BYTES;
+            write.Key = key;
+            write.Value = 0;
+            write.Data.swap(data);
+            writes.push_back(std::move(write));
         }
 
-        bool KeyValueStorage::IsModified()
+        void KeyValueStorage::QueueUInt(std::vector<PendingWrite> &writes, const String &key, const uint32_t value)
         {
-            return _isModified;
+            PendingWrite write;
+            write.Type = WT_UINT;
+            write.Key = key;
+            write.Value = value;
+            writes.push_back(std::move(write));
         }
 
-        bool KeyValueStorage::IsLoaded()
+        void KeyValueStorage::QueueRemove(std::vector<PendingWrite> &writes, const String &key)
         {
-            return _isLoaded;
+            PendingWrite write;
+            write.Type = WT_REMOVE;
+            write.Key = key;
+            write.Value = 0;
+            writes.push_back(std::move(write));
         }
 
-        int32_t KeyValueStorage::GetKeyId(const String &key) const
+        void KeyValueStorage::PrepareBlob(std::vector<PendingWrite> &writes, const String &blobName, const uint32_t shard)
         {
-            auto it = _keys.find(key);
-            if (it != _keys.end())
+            const uint32_t size = GetSerializedSize(shard);
+            if (size > MAX_BUFFERED_BLOB_SIZE && !_compression)
+            {
+                PendingWrite write;
+                write.Type = WT_STREAM;
+                write.Key = blobName;
+                write.Value = size;
+                write.Chunks.reserve((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+                SerializeEntries(shard, [&write](const uint8_t *data, uint32_t dataSize) {
+                    while (dataSize > 0)
+                    {
+                        if (write.Chunks.empty() || write.Chunks.back().size() == CHUNK_SIZE)
+                        {
+                            write.Chunks.emplace_back();
+                            write.Chunks.back().reserve(CHUNK_SIZE);
+                        }
+                        std::vector<uint8_t> &chunk = write.Chunks.back();
+                        const uint32_t count = std::min<uint32_t>(dataSize, CHUNK_SIZE - chunk.size());
+                        chunk.insert(chunk.end(), data, data + count);
+                        data += count;
+                        dataSize -= count;
+                    }
+                });
+                writes.push_back(std::move(write));
+                return;
+            }
+
+            // the blob is allocated once with its final size
+            std::vector<uint8_t> buffer;
+            if (size > 0)
             {
-                return it->second;
+                buffer.reserve(sizeof(BlobHeader) + size);
+                buffer.resize(sizeof(BlobHeader));
+                SerializeEntries(shard, [&buffer](const uint8_t *data, const uint32_t dataSize) {
+                    buffer.insert(buffer.end(), data, data + dataSize);
+                });
+
+                BlobHeader header;
+                header.marker = 0;
+                header.format = BLOB_VERSION_2;
+                header.size = size;
+                memcpy(buffer.data(), &header, sizeof(BlobHeader));
+                EncodeBlob(buffer);
             }
-            return -1;
+            QueueBytes(writes, blobName, buffer);
         }
 
-        bool KeyValueStorage::IsSet(const String &key) const
+        bool KeyValueStorage::StreamBlob(const String &blobName, const std::vector<std::vector<uint8_t>> &chunks, const uint32_t size)
+        {
+            // The chunks are written to the set that the current header does not refer to and the
+            // header is replaced last, so an interrupted save leaves the previous blob readable.
+            BlobHeader header;
+            bool secondSet = false;
+            if (_backend->GetSize(blobName.c_str()) == sizeof(BlobHeader) &&
+                _backend->Read(blobName.c_str(), &header, sizeof(BlobHeader)) == sizeof(BlobHeader) &&
+                header.marker == 0 && (header.format & BLOB_CHUNKED) != 0)
+            {
+                secondSet = (header.format & BLOB_CHUNK_SET) == 0;
+            }
+
+            // a backend with partial writes gets a single chunk, which is appended to
+            const bool partialWrite = _backend->SupportsPartialWrite();
+            const uint32_t chunkCount = partialWrite ? 1 : chunks.size();
+            uint32_t written = 0;
+            for (uint32_t i = 0; i < chunks.size(); i++)
+            {
+                const std::vector<uint8_t> &chunk = chunks[i];
+                const String chunkName = GetChunkName(blobName, secondSet, partialWrite ? 0 : i);
+                const uint32_t result = partialWrite ? _backend->WriteAt(chunkName.c_str(), written, chunk.data(), chunk.size())
+                                                     : _backend->Write(chunkName.c_str(), chunk.data(), chunk.size());
+                if (result != chunk.size())
+                {
+                    return false;
+                }
+                CountWrite(chunk.size());
+                written += chunk.size();
+            }
+
+            header.marker = 0;
+            header.format = BLOB_VERSION_2 | BLOB_CHUNKED | (secondSet ? BLOB_CHUNK_SET : 0);
+            header.size = size;
+            if (_backend->Write(blobName.c_str(), &header, sizeof(BlobHeader)) != sizeof(BlobHeader))
+            {
+                return false;
+            }
+            CountWrite(sizeof(BlobHeader));
+
+            RemoveChunks(blobName, secondSet, chunkCount);
+            RemoveChunks(blobName, !secondSet, 0);
+            return true;
+        }
+
+        void KeyValueStorage::RemoveChunks(const String &blobName, const bool secondSet, const uint32_t firstIndex)
         {
-            return _keys.find(key) != _keys.end();
+            // the chunks of a set are numbered without gaps
+            for (uint32_t i = firstIndex;; i++)
+            {
+                const String chunkName = GetChunkName(blobName, secondSet, i);
+                if (!_backend->Exists(chunkName.c_str()))
+                {
+                    break;
+                }
+                _backend->Remove(chunkName.c_str());
+            }
         }
 
-        bool KeyValueStorage::IsSet(const int32_t keyId) const
+        String KeyValueStorage::GetChunkName(const String &blobName, const bool secondSet, const uint32_t index)
         {
-            return _values.find(keyId) != _values.end();
+            return blobName + (secondSet ? ".b" : ".a") + index;
         }
 
-        void KeyValueStorage::Unset(const String &key)
+        void KeyValueStorage::PrepareSnapshot(std::vector<PendingWrite> &writes)
         {
-            const int32_t keyId = GetKeyId(key);
-            if (keyId > -1)
+            if (_logSegments == 0)
             {
-                _keys.erase(key);
-                _values.erase(keyId);
-                _isModified = true;
+                PrepareBlob(writes, GetBaseName(), ALL_SHARDS);
+            }
+            else
+            {
+                // The log applies to the current base blob, so the new one is written to the other key
+                // and the counter switches to it and drops the log in one write. An interrupted save
+                // leaves the previous base blob and its log readable.
+                const String previousBase = GetBaseName();
+                const uint32_t segments = _logSegments;
+                _secondBase = !_secondBase;
+                PrepareBlob(writes, GetBaseName(), ALL_SHARDS);
+                SetLogCounter(GetLogCounter() & LOG_SECOND_BASE);
+                QueueUInt(writes, "logn", GetLogCounter());
+                for (uint32_t i = 0; i < segments; i++)
+                {
+                    QueueRemove(writes, String("log") + i);
+                }
+                QueueRemove(writes, previousBase);
             }
+
+            // the base blob contains everything now, so the shards are obsolete
+            RemoveShards(writes, 0);
         }
 
-        void KeyValueStorage::Unset(const int32_t keyId)
+        void KeyValueStorage::PrepareLogSegment(std::vector<PendingWrite> &writes)
         {
-            auto it = _values.find(keyId);
-            if (it != _values.end())
+            std::vector<BlobEntry> entries;
+
+            // a key which was removed and added again is written with its value only
+            for (auto &key : _removedKeys)
             {
-                _isModified = true;
-                _values.erase(it);
-                for (auto keyIt = _keys.begin(); keyIt != _keys.end(); ++keyIt)
+                if (FindKey(key.c_str(), HashKey(key.c_str())) < 0)
                 {
-                    if (keyIt->second == keyId)
-                    {
-                        _keys.erase(keyIt);
-                        return;
-                    }
+                    entries.push_back({key.c_str(), nullptr, 0});
+                }
+            }
+
+            uint32_t liveSize = 0;
+            for (const int32_t keyId : _sortedKeys)
+            {
+                const IndexEntry &entry = _entries[keyId];
+                if (entry.valueSize == 0)
+                {
+                    continue;
+                }
+
+                // estimated size of the entry in the base blob
+                const char *key = (const char *)_arena.data() + entry.keyOffset;
+                liveSize += strlen(key) + 2 + entry.valueSize;
+                if (_dirtyKeyIds.find(keyId) != _dirtyKeyIds.end())
+                {
+                    entries.push_back({key, GetValue(entry), entry.valueSize});
                 }
             }
+
+            if (entries.empty())
+            {
+                return;
+            }
+
+            std::vector<uint8_t> buffer;
+            SerializeBlob(entries, buffer);
+            const uint32_t segmentSize = buffer.size() - sizeof(BlobHeader);
+            if (_logSegments >= MAX_LOG_SEGMENTS || _logSize + segmentSize > _compactionRatio * liveSize)
+            {
+                PrepareSnapshot(writes);
+                return;
+            }
+
+            // the segment only becomes visible to Reload() once the counter is updated
+            _logSize += segmentSize;
+            EncodeBlob(buffer);
+            QueueBytes(writes, String("log") + _logSegments, buffer);
+            _logSegments++;
+            QueueUInt(writes, "logn", GetLogCounter());
         }
 
-        int32_t KeyValueStorage::Set(const String &key, const void *value, const uint32_t valueSize)
+        void KeyValueStorage::PrepareShards(std::vector<PendingWrite> &writes)
         {
-            auto it = _keys.find(key);
-            if (it != _keys.end())
+            if (_rewritePending)
             {
-                const int32_t keyId = it->second;
-                Set(keyId, value, valueSize);
-                return keyId;
+                // write all shards
+                _dirtyShards.assign(_shardCount, true);
             }
-            else
+
+            for (uint32_t shard = 0; shard < _shardCount; shard++)
+            {
+                if (!_dirtyShards[shard])
+                {
+                    continue;
+                }
+
+                PrepareBlob(writes, String("s") + shard, shard);
+            }
+
+            if (_rewritePending)
             {
-                std::vector<uint8_t> buff(valueSize);
-                memcpy(buff.data(), value, valueSize);
+                if (_persistedShards > _shardCount)
+                {
+                    RemoveShards(writes, _shardCount);
+                }
+                QueueUInt(writes, "shards", _shardCount);
+                _persistedShards = _shardCount;
 
-                _maxKeyId++;
-                _keys[key] = _maxKeyId;
-                _values[_maxKeyId] = buff;
-                _isModified = true;
-                return _maxKeyId;
+                // drop the base blob and the log of the other modes, "size" was written by older versions
+                QueueRemove(writes, "size");
+                QueueRemove(writes, GetBaseName());
+                RemoveLog(writes);
             }
         }
 
-        bool KeyValueStorage::Set(const int32_t keyId, const void *value, const uint32_t valueSize)
+        void KeyValueStorage::RemoveLog(std::vector<PendingWrite> &writes)
         {
-            auto it = _values.find(keyId);
-            if (it != _values.end())
+            if (_logSegments > 0)
             {
-                auto &buff = it->second;
-                if (buff.size() != valueSize || memcmp(value, buff.data(), valueSize) != 0)
+                const uint32_t segments = _logSegments;
+                SetLogCounter(GetLogCounter() & LOG_SECOND_BASE);
+                QueueUInt(writes, "logn", GetLogCounter());
+                for (uint32_t i = 0; i < segments; i++)
                 {
-                    buff.resize(valueSize);
-                    memcpy(buff.data(), value, valueSize);
-                    _isModified = true;
+                    QueueRemove(writes, String("log") + i);
                 }
-                return true;
             }
-            return false;
         }
 
-        bool KeyValueStorage::Get(const String &key, std::vector<uint8_t> &result) const
+        const char *KeyValueStorage::GetBaseName() const
         {
-            return Get(GetKeyId(key), result);
+            return _secondBase ? "datb" : "data";
         }
 
-        bool KeyValueStorage::Get(const int32_t keyId, std::vector<uint8_t> &result) const
+        uint32_t KeyValueStorage::GetLogCounter() const
+        {
+            return _logSegments | (_secondBase ? LOG_SECOND_BASE : 0);
+        }
+
+        void KeyValueStorage::SetLogCounter(const uint32_t counter)
+        {
+            _secondBase = (counter & LOG_SECOND_BASE) != 0;
+            _logSegments = counter & ~LOG_SECOND_BASE;
+            _logSize = 0;
+        }
+
+        void KeyValueStorage::RemoveShards(std::vector<PendingWrite> &writes, const uint32_t firstShard)
+        {
+            if (_persistedShards > firstShard)
+            {
+                QueueUInt(writes, "shards", firstShard);
+                for (uint32_t i = firstShard; i < _persistedShards; i++)
+                {
+                    QueueRemove(writes, String("s") + i);
+                }
+                _persistedShards = firstShard;
+            }
+        }
+
+        uint32_t KeyValueStorage::ReadBlob(const char *blobName)
+        {
+            // appends the blob to the arena and indexes it, returns the size of its entries
+            const uint32_t offset = _arena.size();
+            uint32_t size = 0;
+            const uint8_t *mapped = _backend->Map(blobName, size);
+            if (mapped == nullptr)
+            {
+                size = _backend->GetSize(blobName);
+            }
+            if (size == 0)
+            {
+                return 0;
+            }
+
+            // a mapped compressed blob is decompressed from the mapping, only its header is copied
+            const uint8_t *compressed = nullptr;
+            uint32_t compressedSize = 0;
+            if (mapped != nullptr && size > sizeof(BlobHeader))
+            {
+                BlobHeader header;
+                memcpy(&header, mapped, sizeof(BlobHeader));
+                if (header.marker == 0 && (header.format & BLOB_COMPRESSED) != 0)
+                {
+                    compressed = mapped + sizeof(BlobHeader);
+                    compressedSize = size - sizeof(BlobHeader);
+                }
+            }
+
+            const uint32_t copySize = compressed != nullptr ? sizeof(BlobHeader) : size;
+            _arena.resize(offset + copySize);
+            if (mapped != nullptr)
+            {
+                memcpy(_arena.data() + offset, mapped, copySize);
+            }
+
+            uint8_t format = 0;
+            uint32_t entriesOffset = offset;
+            if ((mapped == nullptr && _backend->Read(blobName, _arena.data() + offset, size) != size) ||
+                !DecodeBlob(blobName, offset, compressed, compressedSize, format, entriesOffset))
+            {
+                _arena.resize(offset);
+                return 0;
+            }
+
+            const uint32_t entriesSize = _arena.size() - entriesOffset;
+            _garbage += entriesOffset - offset;
+            if ((format & BLOB_VERSION_MASK) == BLOB_VERSION_2)
+            {
+                IndexBlobV2(entriesOffset, entriesSize);
+            }
+            else
+            {
+                IndexBlob(entriesOffset, entriesSize);
+            }
+            return entriesSize;
+        }
+
+        void KeyValueStorage::EncodeBlob(std::vector<uint8_t> &buffer) const
+        {
+            if (!_compression || buffer.size() < sizeof(BlobHeader) + MIN_COMPRESSION_SIZE)
+            {
+                return;
+            }
+
+            const uint32_t entriesSize = buffer.size() - sizeof(BlobHeader);
+            std::vector<uint8_t> compressed;
+            Compression::Compress(buffer.data() + sizeof(BlobHeader), entriesSize, compressed);
+            if (compressed.size() >= entriesSize)
+            {
+                // incompressible, store it as it is
+                return;
+            }
+
+            buffer[offsetof(BlobHeader, format)] |= BLOB_COMPRESSED;
+            buffer.resize(sizeof(BlobHeader) + compressed.size());
+            memcpy(buffer.data() + sizeof(BlobHeader), compressed.data(), compressed.size());
+        }
+
+        bool KeyValueStorage::DecodeBlob(const char *blobName, const uint32_t offset, const uint8_t *compressed, uint32_t compressedSize,
+                                         uint8_t &format, uint32_t &entriesOffset)
         {
-            auto it = _values.find(keyId);
-            if (it != _values.end())
+            // a blob without header starts with the key size of its first v1 entry, which is never 0
+            BlobHeader header;
+            if (_arena.size() - offset < sizeof(BlobHeader))
             {
-                result = it->second;
                 return true;
             }
-            return false;
+            memcpy(&header, _arena.data() + offset, sizeof(BlobHeader));
+            if (header.marker != 0)
+            {
+                return true;
+            }
+
+            format = header.format;
+            const uint8_t version = format & BLOB_VERSION_MASK;
+            if ((version != 0 && version != BLOB_VERSION_2) ||
+                (format & ~(BLOB_VERSION_MASK | BLOB_COMPRESSED | BLOB_CHUNKED | BLOB_CHUNK_SET)) != 0 ||
+                ((format & BLOB_COMPRESSED) != 0 && (format & BLOB_CHUNKED) != 0))
+            {
+                // written by a newer version of the library
+                return false;
+            }
+
+            if ((format & BLOB_CHUNKED) != 0)
+            {
+                // the key only holds the header, the entries follow in the chunks of its set
+                entriesOffset = offset + sizeof(BlobHeader);
+                return _arena.size() == entriesOffset && ReadChunks(blobName, (format & BLOB_CHUNK_SET) != 0, header.size);
+            }
+
+            if ((format & BLOB_COMPRESSED) == 0)
+            {
+                entriesOffset = offset + sizeof(BlobHeader);
+                return header.size == _arena.size() - entriesOffset;
+            }
+
+            // the compressed entries are copied out of the arena unless they are mapped
+            std::vector<uint8_t> copy;
+            if (compressed == nullptr)
+            {
+                copy.assign(_arena.begin() + offset + sizeof(BlobHeader), _arena.end());
+                compressed = copy.data();
+                compressedSize = copy.size();
+            }
+
+            // the size is checked before it is allocated, a corrupted header must not exhaust the heap
+            if (header.size > Compression::GetMaxDecompressedSize(compressedSize))
+            {
+                return false;
+            }
+            _arena.resize(offset + header.size);
+            return Compression::Decompress(compressed, compressedSize, _arena.data() + offset, header.size);
         }
 
-        const std::map<String, int32_t>& KeyValueStorage::GetKeys() const
+        bool KeyValueStorage::ReadChunks(const char *blobName, const bool secondSet, const uint32_t size)
         {
-            return _keys;
+            // the chunks have to add up to the size of the header before it is allocated,
+            // a corrupted header must not exhaust the heap
+            std::vector<uint32_t> chunkSizes;
+            for (uint32_t total = 0; total < size;)
+            {
+                const String chunkName = GetChunkName(blobName, secondSet, chunkSizes.size());
+                const uint32_t chunkSize = _backend->GetSize(chunkName.c_str());
+                if (chunkSize == 0 || chunkSize > size - total)
+                {
+                    return false;
+                }
+                chunkSizes.push_back(chunkSize);
+                total += chunkSize;
+            }
+
+            uint32_t idx = _arena.size();
+            _arena.resize(idx + size);
+            for (uint32_t i = 0; i < chunkSizes.size(); i++)
+            {
+                const String chunkName = GetChunkName(blobName, secondSet, i);
+                if (_backend->Read(chunkName.c_str(), _arena.data() + idx, chunkSizes[i]) != chunkSizes[i])
+                {
+                    return false;
+                }
+                idx += chunkSizes[i];
+            }
+            return true;
         }
 
-        const std::map<int32_t, std::vector<uint8_t>>& KeyValueStorage::GetValues() const
+        void KeyValueStorage::IndexBlob(const uint32_t offset, const uint32_t size)
         {
-            return _values;
+            // v1 layout: EntryHeader, null-terminated key and value of every entry
+            uint32_t idx = offset;
+            const uint32_t endIdx = offset + size;
+            while (idx < endIdx)
+            {
+                EntryHeader header;
+                if (sizeof(EntryHeader) > endIdx - idx) break;
+                memcpy(&header, _arena.data() + idx, sizeof(EntryHeader));
+                const uint32_t keyOffset = idx + sizeof(EntryHeader);
+
+                if (header.keySize > endIdx - keyOffset) break;
+
+                // check null terminatin of key
+                if (header.keySize == 0 || _arena[keyOffset + header.keySize - 1] != 0) break;
+
+                const uint32_t valueOffset = keyOffset + header.keySize;
+                if (header.valueSize > endIdx - valueOffset) break;
+
+                idx = valueOffset + header.valueSize;
+                _garbage += sizeof(EntryHeader);
+
+                const char *key = (const char *)_arena.data() + keyOffset;
+                const uint32_t hash = HashKey(key);
+                const int32_t keyId = FindId(key, hash);
+                if (header.valueSize == 0)
+                {
+                    // tombstone written by the log
+                    _garbage += header.keySize;
+                    if (GetEntry(keyId) != nullptr)
+                    {
+                        RemoveEntry(keyId);
+                    }
+                }
+                else if (keyId > -1)
+                {
+                    // a newer version of the entry or a known key, the old value becomes garbage
+                    _garbage += header.keySize;
+                    RestoreEntry(keyId);
+                    IndexValue(_entries[keyId], valueOffset, header.valueSize);
+                }
+                else
+                {
+                    AddEntry(hash, keyOffset, valueOffset, header.valueSize);
+                }
+            }
+
+            // whatever could not be parsed is unreachable
+            _garbage += endIdx - idx;
+        }
+
+        void KeyValueStorage::IndexBlobV2(const uint32_t offset, const uint32_t size)
+        {
+            // the values are indexed in place, everything else becomes garbage and
+            // the restored keys of new entries are appended behind the blob
+            _garbage += size;
+            uint32_t idx = offset;
+            const uint32_t endIdx = offset + size;
+
+            uint32_t count = 0;
+            if (!ReadVarint(endIdx, idx, count) || count > endIdx - idx)
+            {
+                return;
+            }
+
+            std::vector<char> keys;
+            std::vector<uint32_t> keyOffsets;
+            if (!ReadKeyTable(_arena.data(), endIdx, idx, count, keys, keyOffsets))
+            {
+                return;
+            }
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t valueSize = 0;
+                if (!ReadVarint(endIdx, idx, valueSize) || valueSize > endIdx - idx)
+                {
+                    return;
+                }
+                const uint32_t valueOffset = idx;
+                idx += valueSize;
+
+                const char *key = keys.data() + keyOffsets[i];
+                const uint32_t hash = HashKey(key);
+                const int32_t keyId = FindId(key, hash);
+                if (valueSize == 0)
+                {
+                    // tombstone written by the log
+                    if (GetEntry(keyId) != nullptr)
+                    {
+                        RemoveEntry(keyId);
+                    }
+                }
+                else if (keyId > -1)
+                {
+                    // a newer version of the entry or a known key, the old value becomes garbage
+                    _garbage -= valueSize;
+                    RestoreEntry(keyId);
+                    IndexValue(_entries[keyId], valueOffset, valueSize);
+                }
+                else
+                {
+                    const uint32_t keyOffset = _arena.size();
+                    _arena.insert(_arena.end(), key, key + strlen(key) + 1);
+                    _garbage -= valueSize;
+                    AddEntry(hash, keyOffset, valueOffset, valueSize);
+                }
+            }
+        }
+
+        void KeyValueStorage::SerializeBlob(std::vector<BlobEntry> &entries, std::vector<uint8_t> &buffer) const
+        {
+            // v2 layout: header, entry count, the key table and the values in the same order.
+            // The keys are sorted and stored without the prefix they share with their predecessor.
+            if (entries.empty())
+            {
+                return;
+            }
+
+            std::sort(entries.begin(), entries.end(), [](const BlobEntry &a, const BlobEntry &b) {
+                return strcmp(a.Key, b.Key) < 0;
+            });
+
+            buffer.resize(sizeof(BlobHeader));
+            WriteVarint(buffer, entries.size());
+
+            const char *previous = "";
+            for (auto &entry : entries)
+            {
+                uint32_t shared = 0;
+                while (previous[shared] != 0 && previous[shared] == entry.Key[shared])
+                {
+                    shared++;
+                }
+                WriteVarint(buffer, shared);
+
+                const uint8_t *suffix = (const uint8_t *)entry.Key + shared;
+                buffer.insert(buffer.end(), suffix, suffix + strlen((const char *)suffix) + 1);
+                previous = entry.Key;
+            }
+
+            for (auto &entry : entries)
+            {
+                WriteVarint(buffer, entry.ValueSize);
+                if (entry.ValueSize > 0)
+                {
+                    buffer.insert(buffer.end(), entry.Value, entry.Value + entry.ValueSize);
+                }
+            }
+
+            BlobHeader header;
+            header.marker = 0;
+            header.format = BLOB_VERSION_2;
+            header.size = buffer.size() - sizeof(BlobHeader);
+            memcpy(buffer.data(), &header, sizeof(BlobHeader));
+        }
+
+        void KeyValueStorage::SerializeEntries(const uint32_t shard, const std::function<void(const uint8_t *, const uint32_t)> &emit) const
+        {
+            // same layout as SerializeBlob(), _sortedKeys already has the order of the key table
+            auto isIncluded = [this, shard](const IndexEntry &entry) {
+                return entry.valueSize > 0 && (shard == ALL_SHARDS || entry.hash % _shardCount == shard);
+            };
+
+            uint32_t count = 0;
+            for (const int32_t keyId : _sortedKeys)
+            {
+                count += isIncluded(_entries[keyId]) ? 1 : 0;
+            }
+            if (count == 0)
+            {
+                return;
+            }
+
+            uint8_t varint[5];
+            emit(varint, EncodeVarint(varint, count));
+
+            const char *previous = "";
+            for (const int32_t keyId : _sortedKeys)
+            {
+                if (!isIncluded(_entries[keyId]))
+                {
+                    continue;
+                }
+
+                const char *key = GetKey(keyId);
+                uint32_t shared = 0;
+                while (previous[shared] != 0 && previous[shared] == key[shared])
+                {
+                    shared++;
+                }
+                emit(varint, EncodeVarint(varint, shared));
+                emit((const uint8_t *)key + shared, strlen(key + shared) + 1);
+                previous = key;
+            }
+
+            for (const int32_t keyId : _sortedKeys)
+            {
+                const IndexEntry &entry = _entries[keyId];
+                if (isIncluded(entry))
+                {
+                    emit(varint, EncodeVarint(varint, entry.valueSize));
+                    emit(GetValue(entry), entry.valueSize);
+                }
+            }
+        }
+
+        uint32_t KeyValueStorage::GetSerializedSize(const uint32_t shard) const
+        {
+            uint32_t size = 0;
+            SerializeEntries(shard, [&size](const uint8_t *, const uint32_t dataSize) {
+                size += dataSize;
+            });
+            return size;
+        }
+
+        uint32_t KeyValueStorage::EncodeVarint(uint8_t *buffer, uint32_t value)
+        {
+            // 7 bits per byte, the high bit marks that another byte follows
+            uint32_t size = 0;
+            while (value >= 0x80)
+            {
+                buffer[size++] = (value & 0x7F) | 0x80;
+                value >>= 7;
+            }
+            buffer[size++] = value;
+            return size;
+        }
+
+        void KeyValueStorage::WriteVarint(std::vector<uint8_t> &buffer, uint32_t value)
+        {
+            uint8_t varint[5];
+            buffer.insert(buffer.end(), varint, varint + EncodeVarint(varint, value));
+        }
+
+        bool KeyValueStorage::ReadVarint(const uint32_t endIdx, uint32_t &idx, uint32_t &value) const
+        {
+            return ReadVarint(_arena.data(), endIdx, idx, value);
+        }
+
+        bool KeyValueStorage::ReadVarint(const uint8_t *data, const uint32_t endIdx, uint32_t &idx, uint32_t &value)
+        {
+            value = 0;
+            for (uint32_t shift = 0; shift < 32 && idx < endIdx; shift += 7)
+            {
+                const uint8_t byte = data[idx++];
+                value |= (uint32_t)(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool KeyValueStorage::ReadKeyTable(const uint8_t *data, const uint32_t endIdx, uint32_t &idx, const uint32_t count, std::vector<char> &keys, std::vector<uint32_t> &keyOffsets)
+        {
+            // restores the front coded keys, null-terminated back to back
+            keys.reserve(count * 16);
+            keyOffsets.reserve(count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t shared = 0;
+                if (!ReadVarint(data, endIdx, idx, shared))
+                {
+                    return false;
+                }
+
+                const uint32_t previous = keyOffsets.empty() ? 0 : keyOffsets.back();
+                const uint32_t previousLength = keyOffsets.empty() ? 0 : keys.size() - previous - 1;
+                const char *suffix = (const char *)data + idx;
+                const uint32_t suffixLength = strnlen(suffix, endIdx - idx);
+                if (shared > previousLength || suffixLength == endIdx - idx)
+                {
+                    return false;
+                }
+
+                const uint32_t keyOffset = keys.size();
+                keys.resize(keyOffset + shared + suffixLength + 1);
+                memcpy(keys.data() + keyOffset, keys.data() + previous, shared);
+                memcpy(keys.data() + keyOffset + shared, suffix, suffixLength + 1);
+                keyOffsets.push_back(keyOffset);
+                idx += suffixLength + 1;
+            }
+            return true;
+        }
+
+        void KeyValueStorage::Clear()
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            ScopedLock lock(*this);
+            if (!_sortedKeys.empty() || _pendingShardCount > 0)
+            {
+                _isModified = true;
+                _rewritePending = true;
+
+                // the cleared keys keep their ids
+                RemoveAllEntries();
+                _generation++;
+                _contentHash = 0;
+                _pendingShards.clear();
+                _pendingShardCount = 0;
+                OnModified(-1);
+            }
+        }
+
+        bool KeyValueStorage::IsModified()
+        {
+            return _isModified;
+        }
+
+        bool KeyValueStorage::IsLoaded()
+        {
+            return _isLoaded;
+        }
+
+        bool KeyValueStorage::IsCorrupt() const
+        {
+            return _isCorrupt;
+        }
+
+        uint32_t KeyValueStorage::GetSkippedSaveCount() const
+        {
+            return _skippedSaves;
+        }
+
+        StorageTelemetry KeyValueStorage::GetTelemetry() const
+        {
+            const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+            StorageTelemetry telemetry = _telemetry;
+            telemetry.SkippedSaveCount = _skippedSaves;
+            GiveMutex(saveMutex);
+            return telemetry;
+        }
+
+        void KeyValueStorage::ResetTelemetry()
+        {
+            const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+            {
+                ScopedLock lock(*this);
+                _telemetry = StorageTelemetry();
+                _telemetry.StartMillis = millis();
+                _skippedSaves = 0;
+                _keyWriteCounts.clear();
+            }
+            GiveMutex(saveMutex);
+        }
+
+        void KeyValueStorage::SetKeyWriteCounting(const bool enabled)
+        {
+            ScopedLock lock(*this);
+            _countKeyWrites = enabled;
+            if (!enabled)
+            {
+                _keyWriteCounts.clear();
+            }
+        }
+
+        std::map<String, uint32_t> KeyValueStorage::GetKeyWriteCounts() const
+        {
+            ScopedReadLock lock(*this);
+            return _keyWriteCounts;
+        }
+
+        String KeyValueStorage::FormatTelemetry() const
+        {
+            const StorageTelemetry telemetry = GetTelemetry();
+            const uint32_t elapsedMillis = std::max<uint32_t>(millis() - telemetry.StartMillis, 1);
+            const uint64_t bytesPerDay = telemetry.BytesWritten * 86400000ull / elapsedMillis;
+
+            char line[160];
+            String result;
+            snprintf(line, sizeof(line), "saves: %" PRIu32 " (failed: %" PRIu32 ", skipped: %" PRIu32 "), reloads: %" PRIu32 "\n",
+                     telemetry.SaveCount, telemetry.FailedSaveCount, telemetry.SkippedSaveCount, telemetry.ReloadCount);
+            result += line;
+            snprintf(line, sizeof(line), "flash writes: %" PRIu32 ", bytes: %llu (%llu per day)\n",
+                     telemetry.FlashWriteCount, (unsigned long long)telemetry.BytesWritten, (unsigned long long)bytesPerDay);
+            result += line;
+
+            const LatencyHistogram *histograms[] = {&telemetry.SaveLatency, &telemetry.ReloadLatency};
+            const char *names[] = {"save", "reload"};
+            for (uint32_t i = 0; i < 2; i++)
+            {
+                const LatencyHistogram &histogram = *histograms[i];
+                snprintf(line, sizeof(line), "%s latency: avg %" PRIu32 " us, max %" PRIu32 " us", names[i], histogram.GetAverageMicros(), histogram.MaxMicros);
+                result += line;
+                for (uint32_t bucket = 0; bucket < LatencyHistogram::BucketCount; bucket++)
+                {
+                    if (histogram.Buckets[bucket] > 0)
+                    {
+                        const bool last = bucket == LatencyHistogram::BucketCount - 1;
+                        snprintf(line, sizeof(line), ", %s%u ms: %" PRIu32, last ? ">=" : "<", 1u << (last ? bucket - 1 : bucket), histogram.Buckets[bucket]);
+                        result += line;
+                    }
+                }
+                result += "\n";
+            }
+
+            // the keys that were modified most often
+            std::vector<std::pair<uint32_t, String>> keys;
+            for (auto &count : GetKeyWriteCounts())
+            {
+                keys.push_back(std::make_pair(count.second, count.first));
+            }
+            std::sort(keys.begin(), keys.end(), [](const std::pair<uint32_t, String> &a, const std::pair<uint32_t, String> &b) {
+                return a.first > b.first;
+            });
+            for (uint32_t i = 0; i < keys.size() && i < 10; i++)
+            {
+                snprintf(line, sizeof(line), "%s: %" PRIu32 " writes\n", keys[i].second.c_str(), keys[i].first);
+                result += line;
+            }
+            return result;
+        }
+
+        void KeyValueStorage::PrintTelemetry(HardwareSerial &serial) const
+        {
+            serial.print(FormatTelemetry());
+        }
+
+        void KeyValueStorage::SetBackend(StorageBackend &backend)
+        {
+            _backend = &backend;
+        }
+
+        StorageBackend &KeyValueStorage::GetBackend() const
+        {
+            return *_backend;
+        }
+
+        void KeyValueStorage::SetPersistenceMode(const PersistenceMode mode, const float compactionRatio)
+        {
+            if (mode != _mode)
+            {
+                // the dirty entries are only tracked by the mode that is active
+                _rewritePending = true;
+            }
+            _mode = mode;
+            _compactionRatio = compactionRatio;
+        }
+
+        PersistenceMode KeyValueStorage::GetPersistenceMode() const
+        {
+            return _mode;
+        }
+
+        void KeyValueStorage::SetCompression(const bool enabled)
+        {
+            if (enabled != _compression)
+            {
+                // blobs of both formats can be read, but rewriting them all keeps the layout uniform
+                _compression = enabled;
+                _rewritePending = true;
+            }
+        }
+
+        bool KeyValueStorage::IsCompressionEnabled() const
+        {
+            return _compression;
+        }
+
+        void KeyValueStorage::SetShardCount(const uint32_t shardCount)
+        {
+            const uint32_t count = constrain(shardCount, 1, MAX_SHARDS);
+            if (count != _shardCount)
+            {
+                _shardCount = count;
+                _dirtyShards.assign(_shardCount, false);
+                _rewritePending = true;
+            }
+        }
+
+        uint32_t KeyValueStorage::GetShardCount() const
+        {
+            return _shardCount;
+        }
+
+        int32_t KeyValueStorage::GetKeyId(const String &key) const
+        {
+            return GetKeyId(key.c_str());
+        }
+
+        int32_t KeyValueStorage::GetKeyId(const char *key) const
+        {
+            return GetKeyId(HashedKey(key));
+        }
+
+        int32_t KeyValueStorage::GetKeyId(const HashedKey &key) const
+        {
+            LoadShardOf(key.Hash);
+            {
+                ScopedReadLock lock(*this);
+                const int32_t keyId = FindKey(key.Name, key.Hash);
+                if (keyId < 0 || _entries[keyId].shared)
+                {
+                    return keyId;
+                }
+            }
+
+            // the first time the id is handed out, the key is looked up again, the id may have been reused
+            ScopedLock lock(*this);
+            const int32_t keyId = FindKey(key.Name, key.Hash);
+            if (keyId > -1)
+            {
+                const_cast<KeyValueStorage *>(this)->_entries[keyId].shared = true;
+            }
+            return keyId;
+        }
+
+        int32_t KeyValueStorage::LookupKey(const char *key, const uint32_t hash) const
+        {
+            LoadShardOf(hash);
+            ScopedReadLock lock(*this);
+            return FindKey(key, hash);
+        }
+
+        void KeyValueStorage::SetLazyLoading(const bool enabled)
+        {
+            _lazyLoading = enabled;
+        }
+
+        bool KeyValueStorage::IsLazyLoadingEnabled() const
+        {
+            return _lazyLoading;
+        }
+
+        uint32_t KeyValueStorage::GetPendingShardCount() const
+        {
+            return _pendingShardCount;
+        }
+
+        void KeyValueStorage::LoadShardOf(const uint32_t hash) const
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            // checked without the locks first, nothing is pending in the common case
+            if (_pendingShardCount > 0)
+            {
+                KeyValueStorage *self = const_cast<KeyValueStorage *>(this);
+                const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+                {
+                    ScopedLock lock(*this);
+                    if (!_pendingShards.empty())
+                    {
+                        self->LoadShard(hash % _pendingShards.size());
+                    }
+                }
+                GiveMutex(saveMutex);
+            }
+        }
+
+        void KeyValueStorage::LoadShardOfKey(const int32_t keyId) const
+        {
+            // the shard of a cached id may not have been read again since the last Reload()
+            if (_pendingShardCount > 0)
+            {
+                uint32_t hash = 0;
+                {
+                    ScopedReadLock lock(*this);
+                    if (keyId < 0 || keyId >= (int32_t)_entries.size())
+                    {
+                        return;
+                    }
+                    hash = _entries[keyId].hash;
+                }
+                LoadShardOf(hash);
+            }
+        }
+
+        void KeyValueStorage::LoadPendingShards() const
+        {
+            if (_pendingShardCount > 0)
+            {
+                KeyValueStorage *self = const_cast<KeyValueStorage *>(this);
+                const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+                {
+                    ScopedLock lock(*this);
+                    for (uint32_t shard = 0; shard < _pendingShards.size(); shard++)
+                    {
+                        self->LoadShard(shard);
+                    }
+                }
+                GiveMutex(saveMutex);
+            }
+        }
+
+        void KeyValueStorage::LoadShard(const uint32_t shard)
+        {
+            // requires the save mutex and the data lock
+            if (!_pendingShards[shard])
+            {
+                return;
+            }
+
+            if (_backend->Begin(_name.c_str(), true))
+            {
+                const String blobName = String("s") + shard;
+                ReadBlob(blobName.c_str());
+                _backend->End();
+            }
+            _pendingShards[shard] = false;
+            _pendingShardCount--;
+
+            // the arena may have moved
+            _generation++;
+
+            if (_pendingShardCount == 0)
+            {
+                // the modifications kept the checksum up to date, so it has to match now
+                const uint32_t contentHash = ComputeContentHash();
+                if (contentHash != _contentHash)
+                {
+                    _isCorrupt = true;
+                    _contentHash = contentHash;
+                    _isPersistedHashValid = false;
+                    _rewritePending = true;
+                }
+                _pendingShards.clear();
+            }
+        }
+
+        bool KeyValueStorage::IsSet(const String &key) const
+        {
+            return LookupKey(key.c_str(), HashKey(key.c_str())) > -1;
+        }
+
+        bool KeyValueStorage::IsSet(const int32_t keyId) const
+        {
+            LoadShardOfKey(keyId);
+            ScopedReadLock lock(*this);
+            return GetEntry(keyId) != nullptr;
+        }
+
+        void KeyValueStorage::Unset(const String &key)
+        {
+            Unset(LookupKey(key.c_str(), HashKey(key.c_str())));
+        }
+
+        void KeyValueStorage::Unset(const int32_t keyId)
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            LoadShardOfKey(keyId);
+            ScopedLock lock(*this);
+            if (GetEntry(keyId) != nullptr)
+            {
+                if (IsStaging())
+                {
+                    StageWrite(keyId, String(), nullptr, 0, true);
+                    return;
+                }
+
+                MarkRemoved(GetKey(keyId));
+                RemoveEntry(keyId);
+                _isModified = true;
+                CompactArena();
+                OnModified(keyId);
+            }
+        }
+
+        int32_t KeyValueStorage::Set(const String &key, const void *value, const uint32_t valueSize)
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            const uint32_t hash = HashKey(key.c_str());
+            LoadShardOf(hash);
+            ScopedLock lock(*this);
+            int32_t keyId = FindKey(key.c_str(), hash);
+            if (IsStaging())
+            {
+                // a new key gets its id when the transaction is committed
+                StageWrite(keyId, keyId > -1 ? String() : key, value, valueSize, false);
+                return keyId;
+            }
+
+            if (keyId > -1)
+            {
+                Set(keyId, value, valueSize);
+                return keyId;
+            }
+
+            keyId = InsertEntry(key.c_str(), hash, value, valueSize);
+            _isModified = true;
+            OnModified(keyId);
+            return keyId;
+        }
+
+        int32_t KeyValueStorage::InsertEntry(const char *key, const uint32_t hash, const void *value, const uint32_t valueSize)
+        {
+            // a removed key is set again with its previous id
+            int32_t keyId = FindId(key, hash);
+            if (keyId > -1)
+            {
+                RestoreEntry(keyId);
+                StoreValue(_entries[keyId], value, valueSize);
+                _contentHash += ComputeEntryHash(_entries[keyId]);
+                MarkDirty(keyId);
+                return keyId;
+            }
+
+            const uint32_t keySize = strlen(key) + 1;
+
+            // a small value may be a view into an entry, which moves when the index grows
+            uint8_t inlineValue[IndexEntry::InlineSize];
+            if (valueSize > 0 && valueSize <= IndexEntry::InlineSize)
+            {
+                memcpy(inlineValue, value, valueSize);
+                value = inlineValue;
+            }
+
+            // grow the arena up front, the value may be a view into it
+            const uint8_t *src = (const uint8_t *)value;
+            if (src >= _arena.data() && src < _arena.data() + _arena.size())
+            {
+                const uint32_t srcOffset = src - _arena.data();
+                _arena.reserve(_arena.size() + keySize + valueSize);
+                value = _arena.data() + srcOffset;
+            }
+
+            const uint32_t keyOffset = _arena.size();
+            _arena.insert(_arena.end(), key, key + keySize);
+            keyId = AddEntry(hash, keyOffset, _arena.size(), 0);
+            StoreValue(_entries[keyId], value, valueSize);
+            _contentHash += ComputeEntryHash(_entries[keyId]);
+            MarkDirty(keyId);
+            return keyId;
+        }
+
+        bool KeyValueStorage::StoreEntry(const int32_t keyId, const void *value, const uint32_t valueSize)
+        {
+            IndexEntry &entry = _entries[keyId];
+            if (entry.valueSize == valueSize && memcmp(value, GetValue(entry), valueSize) == 0)
+            {
+                return false;
+            }
+
+            _contentHash -= ComputeEntryHash(entry);
+            StoreValue(entry, value, valueSize);
+            _contentHash += ComputeEntryHash(entry);
+            MarkDirty(keyId);
+            return true;
+        }
+
+        int32_t KeyValueStorage::AddEntry(const uint32_t hash, const uint32_t keyOffset, const uint32_t valueOffset, const uint32_t valueSize)
+        {
+            IndexEntry entry;
+            entry.hash = hash;
+            entry.keyOffset = keyOffset;
+            entry.removed = false;
+            entry.shared = false;
+            entry.valueSize = 0;
+            IndexValue(entry, valueOffset, valueSize);
+
+            int32_t keyId = _entries.size();
+            if (_freeIds.empty())
+            {
+                _entries.push_back(entry);
+            }
+            else
+            {
+                keyId = _freeIds.back();
+                _freeIds.pop_back();
+                _entries[keyId] = entry;
+            }
+
+            const char *key = (const char *)_arena.data() + keyOffset;
+            _sortedKeys.insert(_sortedKeys.begin() + FindPosition(key), keyId);
+            InsertHash(keyId);
+            return keyId;
+        }
+
+        bool KeyValueStorage::Set(const int32_t keyId, const void *value, const uint32_t valueSize)
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            LoadShardOfKey(keyId);
+            ScopedLock lock(*this);
+            if (GetEntry(keyId) == nullptr && keyId > -1 && keyId < (int32_t)_entries.size() && !_entries[keyId].IsFree())
+            {
+                // the key was removed, it is set again with the same id
+                const IndexEntry &entry = _entries[keyId];
+                const String key = (const char *)_arena.data() + entry.keyOffset;
+                if (IsStaging())
+                {
+                    StageWrite(-1, key, value, valueSize, false);
+                }
+                else
+                {
+                    InsertEntry(key.c_str(), entry.hash, value, valueSize);
+                    _isModified = true;
+                    OnModified(keyId);
+                }
+                return true;
+            }
+
+            if (GetEntry(keyId) == nullptr)
+            {
+                if (IsStaging())
+                {
+                    // a write that cannot be applied fails the whole transaction
+                    _transactionFailed = true;
+                }
+                return false;
+            }
+
+            if (IsStaging())
+            {
+                StageWrite(keyId, String(), value, valueSize, false);
+            }
+            else if (StoreEntry(keyId, value, valueSize))
+            {
+                _isModified = true;
+                CompactArena();
+                OnModified(keyId);
+            }
+            return true;
+        }
+
+        bool KeyValueStorage::BeginTransaction()
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            ScopedLock lock(*this);
+            if (_inTransaction)
+            {
+                return false;
+            }
+
+            _inTransaction = true;
+            _transactionFailed = false;
+            _transactionOwner = xTaskGetCurrentTaskHandle();
+            return true;
+        }
+
+        bool KeyValueStorage::Commit(const bool save)
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            if (IsStaging())
+            {
+                // the shards are read before the data lock is taken, only the owner modifies _transaction
+                for (auto &write : _transaction)
+                {
+                    if (write.KeyId < 0)
+                    {
+                        LoadShardOf(HashKey(write.Key.c_str()));
+                    }
+                    else
+                    {
+                        LoadShardOfKey(write.KeyId);
+                    }
+                }
+            }
+
+            bool success = false;
+            {
+                ScopedLock lock(*this);
+                if (!IsStaging())
+                {
+                    return false;
+                }
+
+                success = !_transactionFailed && ApplyTransaction();
+                EndTransaction();
+            }
+
+            // Save() takes the save mutex, which must not be taken while the data lock is held
+            if (success && save)
+            {
+                Save();
+            }
+            return success;
+        }
+
+        void KeyValueStorage::Rollback()
+        {
+            ScopedLock lock(*this);
+            if (IsStaging())
+            {
+                EndTransaction();
+            }
+        }
+
+        bool KeyValueStorage::IsInTransaction() const
+        {
+            return _inTransaction;
+        }
+
+        bool KeyValueStorage::IsStaging() const
+        {
+            return _inTransaction && _transactionOwner == xTaskGetCurrentTaskHandle();
+        }
+
+        void KeyValueStorage::StageWrite(const int32_t keyId, const String &key, const void *value, const uint32_t valueSize, const bool remove)
+        {
+            // the id is applied by Commit(), so it must not be reused in the meantime
+            if (keyId > -1)
+            {
+                _entries[keyId].shared = true;
+            }
+
+            StagedWrite write;
+            write.KeyId = keyId;
+            write.Key = key;
+            write.Remove = remove;
+            if (valueSize > 0)
+            {
+                // copied right away, the value may be a view into the arena
+                write.Value.assign((const uint8_t *)value, (const uint8_t *)value + valueSize);
+            }
+            _transaction.push_back(std::move(write));
+        }
+
+        bool KeyValueStorage::ApplyTransaction()
+        {
+            // only the last write of every key is applied, all of them are validated first
+            std::vector<const StagedWrite *> writes;
+            std::set<int32_t> keyIds;
+            std::set<String> newKeys;
+            for (auto it = _transaction.rbegin(); it != _transaction.rend(); ++it)
+            {
+                if (it->KeyId > -1)
+                {
+                    // another task may have removed the key or reloaded its shard in the meantime
+                    if (GetEntry(it->KeyId) == nullptr)
+                    {
+                        return false;
+                    }
+                    if (!keyIds.insert(it->KeyId).second)
+                    {
+                        continue;
+                    }
+                }
+                else if (!newKeys.insert(it->Key).second)
+                {
+                    continue;
+                }
+                else if (IsShardPending(HashKey(it->Key.c_str())))
+                {
+                    // reloaded after Commit() read the shard, it is read outside the data lock only
+                    return false;
+                }
+                writes.push_back(&*it);
+            }
+
+            bool modified = false;
+            for (auto *write : writes)
+            {
+                int32_t keyId = write->KeyId;
+                if (keyId < 0)
+                {
+                    const uint32_t hash = HashKey(write->Key.c_str());
+                    keyId = FindKey(write->Key.c_str(), hash);
+                    if (keyId < 0)
+                    {
+                        InsertEntry(write->Key.c_str(), hash, write->Value.data(), write->Value.size());
+                        modified = true;
+                        continue;
+                    }
+                }
+
+                if (write->Remove)
+                {
+                    MarkRemoved(GetKey(keyId));
+                    RemoveEntry(keyId);
+                    modified = true;
+                }
+                else
+                {
+                    modified |= StoreEntry(keyId, write->Value.data(), write->Value.size());
+                }
+            }
+
+            // one notification for the whole transaction
+            if (modified)
+            {
+                _isModified = true;
+                CompactArena();
+                OnModified(-1);
+            }
+            return true;
+        }
+
+        bool KeyValueStorage::IsShardPending(const uint32_t hash) const
+        {
+            return !_pendingShards.empty() && _pendingShards[hash % _pendingShards.size()];
+        }
+
+        void KeyValueStorage::EndTransaction()
+        {
+            _transaction.clear();
+            _inTransaction = false;
+            _transactionFailed = false;
+            _transactionOwner = nullptr;
+        }
+
+        const KeyValueStorage::IndexEntry *KeyValueStorage::GetEntry(const int32_t keyId) const
+        {
+            if (keyId > -1 && keyId < (int32_t)_entries.size() && !_entries[keyId].removed)
+            {
+                return &_entries[keyId];
+            }
+            return nullptr;
+        }
+
+        int32_t KeyValueStorage::FindKey(const char *key, const uint32_t hash) const
+        {
+            const int32_t keyId = FindId(key, hash);
+            return keyId > -1 && !_entries[keyId].removed ? keyId : -1;
+        }
+
+        int32_t KeyValueStorage::FindId(const char *key, const uint32_t hash) const
+        {
+            if (_hashTable.empty())
+            {
+                return -1;
+            }
+
+            const uint32_t mask = _hashTable.size() - 1;
+            for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+            {
+                const int32_t keyId = _hashTable[slot];
+                if (keyId == EMPTY_SLOT)
+                {
+                    return -1;
+                }
+
+                const IndexEntry &entry = _entries[keyId];
+                if (entry.hash == hash && strcmp((const char *)_arena.data() + entry.keyOffset, key) == 0)
+                {
+                    return keyId;
+                }
+            }
+        }
+
+        uint32_t KeyValueStorage::FindPosition(const char *key) const
+        {
+            // binary search on the sorted key ids, returns where the key is or would have to be inserted
+            uint32_t first = 0;
+            uint32_t last = _sortedKeys.size();
+
+            // blobs are written in key order, so new keys usually go to the end
+            if (last > 0 && strcmp(GetKey(_sortedKeys[last - 1]), key) < 0)
+            {
+                return last;
+            }
+
+            while (first < last)
+            {
+                const uint32_t middle = first + (last - first) / 2;
+                const int cmp = strcmp(GetKey(_sortedKeys[middle]), key);
+                if (cmp == 0)
+                {
+                    return middle;
+                }
+                if (cmp < 0)
+                {
+                    first = middle + 1;
+                }
+                else
+                {
+                    last = middle;
+                }
+            }
+            return first;
+        }
+
+        void KeyValueStorage::InsertHash(const int32_t keyId)
+        {
+            // keep the load factor below 1/2
+            if (_entries.size() * 2 > _hashTable.size())
+            {
+                RebuildHashTable();
+                return;
+            }
+
+            const uint32_t mask = _hashTable.size() - 1;
+            uint32_t slot = _entries[keyId].hash & mask;
+            while (_hashTable[slot] != EMPTY_SLOT)
+            {
+                slot = (slot + 1) & mask;
+            }
+            _hashTable[slot] = keyId;
+        }
+
+        void KeyValueStorage::RebuildHashTable()
+        {
+            uint32_t size = 16;
+            while (size < _entries.size() * 3)
+            {
+                size *= 2;
+            }
+
+            _hashTable.assign(size, EMPTY_SLOT);
+
+            const uint32_t mask = size - 1;
+            for (int32_t keyId = 0; keyId < (int32_t)_entries.size(); keyId++)
+            {
+                if (_entries[keyId].IsFree())
+                {
+                    continue;
+                }
+
+                uint32_t slot = _entries[keyId].hash & mask;
+                while (_hashTable[slot] != EMPTY_SLOT)
+                {
+                    slot = (slot + 1) & mask;
+                }
+                _hashTable[slot] = keyId;
+            }
+        }
+
+        void KeyValueStorage::RemoveEntry(const int32_t keyId)
+        {
+            IndexEntry &entry = _entries[keyId];
+            const char *key = (const char *)_arena.data() + entry.keyOffset;
+            _contentHash -= ComputeEntryHash(entry);
+
+            _sortedKeys.erase(_sortedKeys.begin() + FindPosition(key));
+
+            // the key stays in the arena for the id, an id that was never handed out
+            // is freed with its key by CompactArena()
+            if (!entry.shared)
+            {
+                _garbage += strlen(key) + 1;
+            }
+            if (!entry.IsInline())
+            {
+                _garbage += entry.capacity;
+            }
+            entry.valueSize = 0;
+            entry.removed = true;
+            _generation++;
+        }
+
+        void KeyValueStorage::RestoreEntry(const int32_t keyId)
+        {
+            IndexEntry &entry = _entries[keyId];
+            if (entry.removed)
+            {
+                entry.removed = false;
+                const char *key = (const char *)_arena.data() + entry.keyOffset;
+                _sortedKeys.insert(_sortedKeys.begin() + FindPosition(key), keyId);
+                if (!entry.shared)
+                {
+                    _garbage -= strlen(key) + 1;
+                }
+            }
+        }
+
+        void KeyValueStorage::RemoveAllEntries()
+        {
+            // only the keys of the handed out ids are kept, so the arena is rebuilt right away
+            std::vector<uint8_t> arena;
+            for (int32_t keyId = 0; keyId < (int32_t)_entries.size(); keyId++)
+            {
+                IndexEntry &entry = _entries[keyId];
+                entry.valueSize = 0;
+                entry.removed = true;
+                if (!entry.shared)
+                {
+                    entry.keyOffset = IndexEntry::FreeKeyOffset;
+                    _dirtyKeyIds.erase(keyId);
+                    continue;
+                }
+
+                const char *key = (const char *)_arena.data() + entry.keyOffset;
+                const uint32_t keyOffset = arena.size();
+                arena.insert(arena.end(), key, key + strlen(key) + 1);
+                entry.keyOffset = keyOffset;
+            }
+            _arena.swap(arena);
+            _sortedKeys.clear();
+            _garbage = 0;
+            ReleaseFreeEntries();
+        }
+
+        void KeyValueStorage::ReleaseFreeEntries()
+        {
+            // free ids at the end are dropped, the others are reused by AddEntry()
+            while (!_entries.empty() && _entries.back().IsFree())
+            {
+                _entries.pop_back();
+            }
+            _freeIds.clear();
+            for (int32_t keyId = _entries.size() - 1; keyId > -1; keyId--)
+            {
+                if (_entries[keyId].IsFree())
+                {
+                    _freeIds.push_back(keyId);
+                }
+            }
+            RebuildHashTable();
+        }
+
+        void KeyValueStorage::StoreValue(IndexEntry &entry, const void *value, const uint32_t valueSize)
+        {
+            if (valueSize <= IndexEntry::InlineSize)
+            {
+                // the value may be the inline value of the entry itself
+                if (!entry.IsInline())
+                {
+                    _garbage += entry.capacity;
+                }
+                if (valueSize > 0)
+                {
+                    memmove(entry.inlineValue, value, valueSize);
+                }
+                entry.valueSize = valueSize;
+                _generation++;
+                return;
+            }
+
+            if (entry.IsInline() || valueSize > entry.capacity)
+            {
+                // the value may be a view into the arena, which moves when the arena grows
+                const uint8_t *src = (const uint8_t *)value;
+                const bool aliased = src >= _arena.data() && src < _arena.data() + _arena.size();
+                const uint32_t srcOffset = aliased ? src - _arena.data() : 0;
+
+                // the old location becomes garbage, it is reclaimed by CompactArena()
+                if (!entry.IsInline())
+                {
+                    _garbage += entry.capacity;
+                }
+                entry.valueOffset = _arena.size();
+                entry.capacity = valueSize;
+                _arena.resize(_arena.size() + valueSize);
+
+                if (aliased)
+                {
+                    value = _arena.data() + srcOffset;
+                }
+            }
+            entry.valueSize = valueSize;
+            _generation++;
+            // the value may be a view into the same location, e.g. a part of the current value
+            memmove(_arena.data() + entry.valueOffset, value, valueSize);
+        }
+
+        void KeyValueStorage::IndexValue(IndexEntry &entry, const uint32_t valueOffset, const uint32_t valueSize)
+        {
+            // a loaded value stays where it is in the arena unless it fits into the entry
+            if (!entry.IsInline())
+            {
+                _garbage += entry.capacity;
+            }
+            entry.valueSize = valueSize;
+            if (entry.IsInline())
+            {
+                if (valueSize > 0)
+                {
+                    memcpy(entry.inlineValue, _arena.data() + valueOffset, valueSize);
+                    _garbage += valueSize;
+                }
+            }
+            else
+            {
+                entry.valueOffset = valueOffset;
+                entry.capacity = valueSize;
+            }
+        }
+
+        void KeyValueStorage::CompactArena()
+        {
+            if (_garbage < MIN_ARENA_GARBAGE || _garbage < _arena.size() / 2)
+            {
+                return;
+            }
+
+            std::vector<uint8_t> arena;
+            arena.reserve(_arena.size() - _garbage);
+            bool freed = false;
+            for (int32_t keyId = 0; keyId < (int32_t)_entries.size(); keyId++)
+            {
+                IndexEntry &entry = _entries[keyId];
+                if (entry.IsFree())
+                {
+                    continue;
+                }
+                if (entry.removed && !entry.shared)
+                {
+                    // nobody knows the id, so the key is dropped
+                    entry.keyOffset = IndexEntry::FreeKeyOffset;
+                    _dirtyKeyIds.erase(keyId);
+                    freed = true;
+                    continue;
+                }
+
+                const uint8_t *key = _arena.data() + entry.keyOffset;
+                entry.keyOffset = arena.size();
+                arena.insert(arena.end(), key, key + strlen((const char *)key) + 1);
+                if (!entry.IsInline())
+                {
+                    const uint8_t *value = _arena.data() + entry.valueOffset;
+                    entry.valueOffset = arena.size();
+                    arena.insert(arena.end(), value, value + entry.capacity);
+                }
+            }
+            _arena.swap(arena);
+            _garbage = 0;
+            _generation++;
+            if (freed)
+            {
+                ReleaseFreeEntries();
+            }
+        }
+
+        void KeyValueStorage::OnModified(const int32_t keyId)
+        {
+        }
+
+        bool KeyValueStorage::IsExported(const char *key) const
+        {
+            return true;
+        }
+
+        void KeyValueStorage::EnableLocking()
+        {
+            if (_dataMutex == nullptr)
+            {
+                // _dataMutex enables the locks, it is created last
+                _readersDone = xSemaphoreCreateBinary();
+                _saveMutex = xSemaphoreCreateRecursiveMutex();
+                _dataMutex = xSemaphoreCreateRecursiveMutex();
+            }
+        }
+
+        bool KeyValueStorage::Lock() const
+        {
+            if (_dataMutex == nullptr)
+            {
+                return false;
+            }
+
+            // new readers have to wait for the mutex, so only the active ones need to finish,
+            // the last one gives _readersDone. A give without a waiting writer is left over, so
+            // the count is checked again after every take.
+            TakeMutex(_dataMutex);
+            while (_readers > 0)
+            {
+                xSemaphoreTake(_readersDone, portMAX_DELAY);
+            }
+            return true;
+        }
+
+        void KeyValueStorage::Unlock(const bool locked) const
+        {
+            if (locked)
+            {
+                GiveMutex(_dataMutex);
+            }
+        }
+
+        bool KeyValueStorage::ReadLock() const
+        {
+            if (_dataMutex == nullptr)
+            {
+                return false;
+            }
+
+            // the mutex is only held to register the reader
+            TakeMutex(_dataMutex);
+            _readers++;
+            GiveMutex(_dataMutex);
+            return true;
+        }
+
+        void KeyValueStorage::ReadUnlock(const bool locked) const
+        {
+            if (locked && --_readers == 0)
+            {
+                xSemaphoreGive(_readersDone);
+            }
+        }
+
+        SemaphoreHandle_t KeyValueStorage::TakeMutex(SemaphoreHandle_t mutex)
+        {
+            if (mutex != nullptr)
+            {
+                xSemaphoreTakeRecursive(mutex, portMAX_DELAY);
+            }
+            return mutex;
+        }
+
+        void KeyValueStorage::GiveMutex(SemaphoreHandle_t mutex)
+        {
+            if (mutex != nullptr)
+            {
+                xSemaphoreGiveRecursive(mutex);
+            }
+        }
+
+        uint32_t KeyValueStorage::ComputeHash(const void *data, const uint32_t size, const uint32_t crc)
+        {
+            // nibble-wise, the 16 entry table is a good tradeoff between speed and memory
+            static const uint32_t table[16] = {
+                0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+                0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+            uint32_t result = ~crc;
+            const uint8_t *ptr = (const uint8_t *)data;
+            for (uint32_t i = 0; i < size; i++)
+            {
+                result = table[(result ^ ptr[i]) & 0x0F] ^ (result >> 4);
+                result = table[(result ^ (ptr[i] >> 4)) & 0x0F] ^ (result >> 4);
+            }
+            return ~result;
+        }
+
+        uint32_t KeyValueStorage::ComputeEntryHash(const IndexEntry &entry) const
+        {
+            // empty values are not persisted
+            if (entry.valueSize == 0)
+            {
+                return 0;
+            }
+
+            const char *key = (const char *)_arena.data() + entry.keyOffset;
+            const uint32_t crc = ComputeHash(key, strlen(key) + 1);
+            return ComputeHash(GetValue(entry), entry.valueSize, crc);
+        }
+
+        uint32_t KeyValueStorage::ComputeContentHash() const
+        {
+            uint32_t result = 0;
+            for (const int32_t keyId : _sortedKeys)
+            {
+                result += ComputeEntryHash(_entries[keyId]);
+            }
+            return result;
+        }
+
+        void KeyValueStorage::MarkDirty(const int32_t keyId)
+        {
+            if (_countKeyWrites)
+            {
+                _keyWriteCounts[GetKey(keyId)]++;
+            }
+
+            if (_mode == PM_LOG)
+            {
+                _dirtyKeyIds.insert(keyId);
+            }
+            else if (_mode == PM_SHARDED && !_rewritePending)
+            {
+                _dirtyShards[_entries[keyId].hash % _shardCount] = true;
+            }
+        }
+
+        void KeyValueStorage::MarkRemoved(const char *key)
+        {
+            if (_countKeyWrites)
+            {
+                _keyWriteCounts[key]++;
+            }
+
+            if (_mode == PM_LOG)
+            {
+                _removedKeys.insert(key);
+            }
+            else if (_mode == PM_SHARDED && !_rewritePending)
+            {
+                _dirtyShards[HashKey(key) % _shardCount] = true;
+            }
+        }
+
+        bool KeyValueStorage::Get(const String &key, std::vector<uint8_t> &result) const
+        {
+            return Get(LookupKey(key.c_str(), HashKey(key.c_str())), result);
+        }
+
+        bool KeyValueStorage::Get(const int32_t keyId, std::vector<uint8_t> &result) const
+        {
+            LoadShardOfKey(keyId);
+            ScopedReadLock lock(*this);
+            const IndexEntry *entry = GetEntry(keyId);
+            if (entry != nullptr)
+            {
+                const uint8_t *value = GetValue(*entry);
+                result.assign(value, value + entry->valueSize);
+                return true;
+            }
+            return false;
+        }
+
+        bool KeyValueStorage::GetView(const String &key, ValueView &result) const
+        {
+            return GetView(LookupKey(key.c_str(), HashKey(key.c_str())), result);
+        }
+
+        bool KeyValueStorage::GetView(const int32_t keyId, ValueView &result) const
+        {
+            LoadShardOfKey(keyId);
+            ScopedReadLock lock(*this);
+            const IndexEntry *entry = GetEntry(keyId);
+            if (entry != nullptr)
+            {
+                result._data = GetValue(*entry);
+                result._size = entry->valueSize;
+                result._storage = this;
+                result._generation = _generation;
+                return true;
+            }
+            return false;
+        }
+
+        uint32_t KeyValueStorage::GetGeneration() const
+        {
+            return _generation;
+        }
+
+        uint32_t KeyValueStorage::GetKeyCount() const
+        {
+            LoadPendingShards();
+            ScopedReadLock lock(*this);
+            return _sortedKeys.size();
+        }
+
+        const char *KeyValueStorage::GetKey(const int32_t keyId) const
+        {
+            const IndexEntry *entry = GetEntry(keyId);
+            if (entry != nullptr)
+            {
+                return (const char *)_arena.data() + entry->keyOffset;
+            }
+            return nullptr;
+        }
+
+        void KeyValueStorage::Export(std::vector<uint8_t> &result, const String &prefix) const
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            LoadPendingShards();
+            ScopedReadLock lock(*this);
+
+            // the keys with the prefix are next to each other in the sorted keys
+            std::vector<BlobEntry> entries;
+            for (uint32_t i = FindPosition(prefix.c_str()); i < _sortedKeys.size(); i++)
+            {
+                const IndexEntry &entry = _entries[_sortedKeys[i]];
+                const char *key = (const char *)_arena.data() + entry.keyOffset;
+                if (strncmp(key, prefix.c_str(), prefix.length()) != 0)
+                {
+                    break;
+                }
+                if (entry.valueSize > 0 && IsExported(key))
+                {
+                    entries.push_back({key, GetValue(entry), entry.valueSize});
+                }
+            }
+
+            // the layout of a v2 blob with its own marker, followed by the checksum of both
+            result.clear();
+            SerializeBlob(entries, result);
+            if (result.empty())
+            {
+                result.resize(sizeof(BlobHeader));
+                WriteVarint(result, 0);
+            }
+
+            BlobHeader header;
+            header.marker = EXPORT_MARKER;
+            header.format = BLOB_VERSION_2;
+            header.size = result.size() - sizeof(BlobHeader);
+            memcpy(result.data(), &header, sizeof(BlobHeader));
+
+            const uint32_t crc = ComputeHash(result.data(), result.size());
+            result.insert(result.end(), (const uint8_t *)&crc, (const uint8_t *)&crc + sizeof(uint32_t));
+        }
+
+        bool KeyValueStorage::Import(const uint8_t *data, const uint32_t size, const bool save)
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            if (size < sizeof(BlobHeader) + sizeof(uint32_t))
+            {
+                return false;
+            }
+
+            BlobHeader header;
+            uint32_t crc = 0;
+            const uint32_t endIdx = size - sizeof(uint32_t);
+            memcpy(&header, data, sizeof(BlobHeader));
+            memcpy(&crc, data + endIdx, sizeof(uint32_t));
+            if (header.marker != EXPORT_MARKER || header.format != BLOB_VERSION_2 ||
+                header.size != endIdx - sizeof(BlobHeader) || crc != ComputeHash(data, endIdx))
+            {
+                return false;
+            }
+
+            // everything is validated before the first key is set
+            uint32_t idx = sizeof(BlobHeader);
+            uint32_t count = 0;
+            std::vector<char> keys;
+            std::vector<uint32_t> keyOffsets;
+            if (!ReadVarint(data, endIdx, idx, count) || count > endIdx - idx ||
+                !ReadKeyTable(data, endIdx, idx, count, keys, keyOffsets))
+            {
+                return false;
+            }
+
+            std::vector<BlobEntry> entries;
+            entries.reserve(count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t valueSize = 0;
+                if (!ReadVarint(data, endIdx, idx, valueSize) || valueSize == 0 || valueSize > endIdx - idx)
+                {
+                    return false;
+                }
+                entries.push_back({keys.data() + keyOffsets[i], data + idx, valueSize});
+                idx += valueSize;
+            }
+            if (idx != endIdx)
+            {
+                return false;
+            }
+
+            Load();
+            LoadPendingShards();
+            {
+                ScopedLock lock(*this);
+                if (_pendingShardCount > 0)
+                {
+                    // reloaded in the meantime, the shards are read outside the data lock only
+                    return false;
+                }
+                if (save && IsStaging())
+                {
+                    // the staged keys would not be saved before the commit
+                    return false;
+                }
+
+                bool modified = false;
+                for (auto &entry : entries)
+                {
+                    const uint32_t hash = HashKey(entry.Key);
+                    const int32_t keyId = FindKey(entry.Key, hash);
+                    if (IsStaging())
+                    {
+                        StageWrite(keyId, keyId > -1 ? String() : String(entry.Key), entry.Value, entry.ValueSize, false);
+                    }
+                    else if (keyId < 0)
+                    {
+                        InsertEntry(entry.Key, hash, entry.Value, entry.ValueSize);
+                        modified = true;
+                    }
+                    else
+                    {
+                        modified |= StoreEntry(keyId, entry.Value, entry.ValueSize);
+                    }
+                }
+
+                // one notification for all keys, like a transaction
+                if (modified)
+                {
+                    _isModified = true;
+                    CompactArena();
+                    OnModified(-1);
+                }
+            }
+
+            if (save)
+            {
+                Save();
+            }
+            return true;
+        }
+
+        std::vector<String> KeyValueStorage::GetKeys() const
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            LoadPendingShards();
+            ScopedReadLock lock(*this);
+            std::vector<String> result;
+            result.reserve(_sortedKeys.size());
+            for (const int32_t keyId : _sortedKeys)
+            {
+                result.push_back(GetKey(keyId));
+            }
+            return result;
+        }
+
+        std::map<String, int32_t> KeyValueStorage::GetKeyIds() const
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            LoadPendingShards();
+            // the ids are handed out, which requires the data lock
+            ScopedLock lock(*this);
+            std::map<String, int32_t> result;
+            for (const int32_t keyId : _sortedKeys)
+            {
+                const_cast<KeyValueStorage *>(this)->_entries[keyId].shared = true;
+                result.emplace_hint(result.end(), GetKey(keyId), keyId);
+            }
+            return result;
+        }
+
+        std::map<int32_t, std::vector<uint8_t>> KeyValueStorage::GetValues() const
+        {
+            HeapScope heapScope(HS_KEY_VALUE_STORAGE);
+            LoadPendingShards();
+            ScopedLock lock(*this);
+            std::map<int32_t, std::vector<uint8_t>> result;
+            for (const int32_t keyId : _sortedKeys)
+            {
+                IndexEntry &entry = const_cast<KeyValueStorage *>(this)->_entries[keyId];
+                entry.shared = true;
+                const uint8_t *value = GetValue(entry);
+                result.emplace(keyId, std::vector<uint8_t>(value, value + entry.valueSize));
+            }
+            return result;
         }
     }
 }
\ No newline at end of file
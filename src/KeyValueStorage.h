@@ -1,16 +1,102 @@
 #pragma once
 #include <Arduino.h>
 #include <EEPROM.h>
+#include <atomic>
+#include <functional>
 #include <map>
+#include <set>
 #include <vector>
-#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "StorageBackend.h"
 
 namespace esp32
 {
     namespace foundation
     {
+        enum PersistenceMode
+        {
+            PM_SNAPSHOT = 0, // every save rewrites the whole blob
+            PM_LOG,          // saves append the modified entries to a log
+            PM_SHARDED       // keys are hashed into shards, saves only rewrite modified shards
+        };
+
+        // FNV-1a hash of a null-terminated key, evaluated at compile time for constant keys
+        constexpr uint32_t HashKey(const char *key, const uint32_t hash = 2166136261u)
+        {
+            return *key == 0 ? hash : HashKey(key + 1, (hash ^ (uint8_t)*key) * 16777619u);
+        }
+
+        // key name together with its hash, a constexpr instance is hashed at compile time:
+        // static constexpr HashedKey WifiSsid("wifi_ssid");
+        struct HashedKey
+        {
+            const char *Name;
+            const uint32_t Hash;
+
+            explicit constexpr HashedKey(const char *name)
+                : Name(name),
+                  Hash(HashKey(name))
+            {
+            }
+        };
+
+        class KeyValueStorage;
+
+        // counts durations in buckets of powers of two milliseconds: < 1 ms, < 2 ms, ... < 512 ms and >= 512 ms
+        struct LatencyHistogram
+        {
+            static const uint32_t BucketCount = 11;
+
+            uint32_t Buckets[BucketCount];
+            uint32_t Count;
+            uint32_t MaxMicros;
+            uint64_t TotalMicros;
+
+            void Add(const uint32_t duration);
+            uint32_t GetAverageMicros() const;
+        };
+
+        // Counters since the storage was created or ResetTelemetry() was called. SaveCount only includes
+        // saves that wrote something, FlashWriteCount and BytesWritten every blob and counter written.
+        struct StorageTelemetry
+        {
+            uint32_t SaveCount;
+            uint32_t FailedSaveCount;
+            uint32_t SkippedSaveCount;
+            uint32_t ReloadCount;
+            uint32_t FlashWriteCount;
+            uint64_t BytesWritten;
+            uint32_t StartMillis;
+            LatencyHistogram SaveLatency;
+            LatencyHistogram ReloadLatency;
+        };
+
+        // Non-owning view of a stored value. It is only valid until the
+        // storage is modified, debug builds assert on stale access.
+        class ValueView
+        {
+        public:
+            ValueView();
+
+            const uint8_t *Data() const;
+            uint32_t Size() const;
+            bool IsValid() const;
+
+        private:
+            friend class KeyValueStorage;
+
+            const uint8_t *_data;
+            uint32_t _size;
+            const KeyValueStorage *_storage;
+            uint32_t _generation;
+        };
+
         class KeyValueStorage
         {
+            friend class StorageManager;
+
         protected:
             struct EntryHeader
             {
@@ -18,6 +104,121 @@ namespace esp32
                 uint32_t valueSize;
             };
 
+            // prefix of encoded blobs, marker is 0 where a v1 blob without header has the key size of its
+            // first entry, format holds the entry layout version (high nibble) and the encoding flags
+            struct __attribute__((packed)) BlobHeader
+            {
+                uint32_t marker;
+                uint8_t format;
+                uint32_t size;
+            };
+
+            // an entry to serialize, ValueSize 0 is a tombstone
+            struct BlobEntry
+            {
+                const char *Key;
+                const uint8_t *Value;
+                uint32_t ValueSize;
+            };
+
+            enum WriteType
+            {
+                WT_BYTES = 0,
+                WT_UINT,
+                WT_REMOVE,
+                WT_STREAM // Chunks hold the entries of the blob Key, Value their size
+            };
+
+            // a flash operation, collected under the data lock and executed after releasing it, the entries
+            // of a WT_STREAM write are copied into chunks, so no large block has to be allocated for them
+            struct PendingWrite
+            {
+                WriteType Type;
+                String Key;
+                uint32_t Value;
+                std::vector<uint8_t> Data;
+                std::vector<std::vector<uint8_t>> Chunks;
+            };
+
+            // a Set() or Unset() collected by a transaction, KeyId is -1 for keys that did not exist
+            struct StagedWrite
+            {
+                int32_t KeyId;
+                String Key;
+                std::vector<uint8_t> Value;
+                bool Remove;
+            };
+
+            class ScopedLock
+            {
+            public:
+                ScopedLock(const KeyValueStorage &storage) : _storage(storage), _locked(storage.Lock())
+                {
+                }
+
+                ~ScopedLock()
+                {
+                    _storage.Unlock(_locked);
+                }
+
+            private:
+                const KeyValueStorage &_storage;
+                const bool _locked;
+            };
+
+            class ScopedReadLock
+            {
+            public:
+                ScopedReadLock(const KeyValueStorage &storage) : _storage(storage), _locked(storage.ReadLock())
+                {
+                }
+
+                ~ScopedReadLock()
+                {
+                    _storage.ReadUnlock(_locked);
+                }
+
+            private:
+                const KeyValueStorage &_storage;
+                const bool _locked;
+            };
+
+            // location of a key in the arena, values up to InlineSize bytes are stored in the entry itself,
+            // a removed entry keeps its key, so the key gets the same id when it is set again. If the id
+            // was never handed out, the next compaction of the arena frees the entry instead.
+            struct IndexEntry
+            {
+                static const uint32_t InlineSize = 8;
+                // keyOffset of an entry whose id is free for a new key
+                static const uint32_t FreeKeyOffset = (1u << 30) - 1;
+
+                uint32_t hash;
+                uint32_t keyOffset : 30;
+                uint32_t removed : 1;
+                // the id was handed out by GetKeyId() or staged by a transaction, so it is kept when the key is removed
+                uint32_t shared : 1;
+                uint32_t valueSize;
+                union
+                {
+                    struct
+                    {
+                        uint32_t valueOffset;
+                        uint32_t capacity;
+                    };
+                    uint8_t inlineValue[InlineSize];
+                };
+
+                bool IsInline() const
+                {
+                    return valueSize <= InlineSize;
+                }
+
+                bool IsFree() const
+                {
+                    return keyOffset == FreeKeyOffset;
+                }
+            };
+
         public:
             KeyValueStorage(const String& name);
 
@@ -30,7 +231,70 @@ namespace esp32
             bool IsModified();
             bool IsLoaded();
 
+            // true if the content loaded by the last Reload() did not match its persisted checksum
+            bool IsCorrupt() const;
+
+            // number of saves that were skipped because the content equaled the persisted one
+            uint32_t GetSkippedSaveCount() const;
+
+            StorageTelemetry GetTelemetry() const;
+            void ResetTelemetry();
+
+            // counts the modifications per key, which are what the saves write to the flash
+            void SetKeyWriteCounting(const bool enabled);
+            std::map<String, uint32_t> GetKeyWriteCounts() const;
+
+            // the telemetry as text, with the keys that were modified most often if they are counted
+            String FormatTelemetry() const;
+            void PrintTelemetry(HardwareSerial &serial) const;
+
+            // the backend persists the blobs, it defaults to the Preferences of the ESP32 and
+            // has to outlive the storage, set it before the storage is loaded
+            void SetBackend(StorageBackend &backend);
+            StorageBackend &GetBackend() const;
+
+            // compactionRatio: the log is merged into the base blob as soon as
+            // its size exceeds compactionRatio * size of the live data
+            void SetPersistenceMode(const PersistenceMode mode, const float compactionRatio = 1.0f);
+            PersistenceMode GetPersistenceMode() const;
+
+            // compresses the persisted blobs, blobs of both formats are read regardless of this setting
+            void SetCompression(const bool enabled);
+            bool IsCompressionEnabled() const;
+
+            // number of shards used by PM_SHARDED
+            void SetShardCount(const uint32_t shardCount);
+            uint32_t GetShardCount() const;
+
+            // PM_SHARDED only: Reload() reads the shards on the first lookup of one of their keys,
+            // GetKeys(), GetKeyCount() and a Save() that rewrites all shards read the remaining ones.
+            // A lookup which reads a shard invalidates the views like a modification.
+            // A ParameterSet reads all shards on reload, its snapshot contains every value.
+            void SetLazyLoading(const bool enabled);
+            bool IsLazyLoadingEnabled() const;
+            uint32_t GetPendingShardCount() const;
+
+            // makes the storage safe to use from several tasks: modifications are serialized and
+            // readers run concurrently. A waiting writer holds back new readers, so they wait for
+            // the in-memory part of a modification or a Save(), never for the flash access.
+            void EnableLocking();
+
+            // Set() and Unset() calls of the task that began the transaction are collected and
+            // applied by Commit() at once. Reads return the committed values until then. A write
+            // that cannot be applied fails the commit and leaves the storage unchanged.
+            bool BeginTransaction();
+            bool Commit(const bool save = false);
+            void Rollback();
+            bool IsInTransaction() const;
+
+            // A key keeps the id returned by GetKeyId() for the lifetime of the storage, also after Unset(),
+            // Clear() and Reload(). Set() with the id of a removed key sets it again, the other calls treat it
+            // as not set. The id returned by Set() is only valid while the key is set, the ids of removed keys
+            // that GetKeyId() never returned are reused after Clear(), Reload() and once the arena is compacted,
+            // so the index only holds the keys that are set and those whose id was returned by GetKeyId().
             int32_t GetKeyId(const String &key) const;
+            int32_t GetKeyId(const char *key) const;
+            int32_t GetKeyId(const HashedKey &key) const;
 
             bool IsSet(const String &key) const;
             bool IsSet(const int32_t keyId) const;
@@ -44,6 +308,12 @@ namespace esp32
             bool Get(const String &key, std::vector<uint8_t>& result) const;
             bool Get(const int32_t keyId, std::vector<uint8_t>& result) const;
 
+            bool GetView(const String &key, ValueView &result) const;
+            bool GetView(const int32_t keyId, ValueView &result) const;
+
+            // incremented by every modification that invalidates views
+            uint32_t GetGeneration() const;
+
             template <typename T>
             int32_t Set(const String &key, const T& value)
             {
@@ -59,35 +329,203 @@ namespace esp32
             template <typename T>
             bool Get(const String &key, T& result) const
             {
-                return Get<T>(GetKeyId(key), result);
+                return Get<T>(LookupKey(key.c_str(), HashKey(key.c_str())), result);
             }
 
             template <typename T>
             bool Get(const int32_t keyId, T& result) const
             {
-                auto it = _values.find(keyId);
-                if (it != _values.end() && it->second.size() == sizeof(T))
+                LoadShardOfKey(keyId);
+                ScopedReadLock lock(*this);
+                const IndexEntry *entry = GetEntry(keyId);
+                if (entry != nullptr && entry->valueSize == sizeof(T))
                 {
-                    memcpy(&result, it->second.data(), sizeof(T));
+                    memcpy(&result, GetValue(*entry), sizeof(T));
                     return true;
                 }
                 return false;
             }
 
-            const std::map<String, int32_t>& GetKeys() const;
-            const std::map<int32_t, std::vector<uint8_t>>& GetValues() const;
+            uint32_t GetKeyCount() const;
+            const char *GetKey(const int32_t keyId) const;
+            // the keys that are set, ordered by key
+            std::vector<String> GetKeys() const;
+            // copies in the containers of the former GetKeys() and GetValues(), their ids are kept like the ones of GetKeyId()
+            std::map<String, int32_t> GetKeyIds() const;
+            std::map<int32_t, std::vector<uint8_t>> GetValues() const;
+
+            // A versioned and checksummed copy of the keys that start with prefix, e.g. to provision
+            // other devices with it. Import() sets all of its keys at once and keeps the other keys.
+            // In a transaction the keys are staged and Commit(true) saves them, Import() with save fails.
+            void Export(std::vector<uint8_t> &result, const String &prefix = "") const;
+            bool Import(const uint8_t *data, const uint32_t size, const bool save = true);
 
         protected:
-            uint32_t ComputeHash(const void *storage) const;
+            // called for every modification by Set(), Unset(), Clear() and Commit() (both keyId -1) while the data lock is held
+            virtual void OnModified(const int32_t keyId);
+            // Export() leaves out the keys for which it returns false
+            virtual bool IsExported(const char *key) const;
+
+            // Lock() waits for the active readers, a task must not modify the storage while it holds a read lock
+            // Lock() and ReadLock() return whether they locked, the result is passed to the unlock call,
+            // so EnableLocking() may be called while another task holds a lock
+            bool Lock() const;
+            void Unlock(const bool locked) const;
+            bool ReadLock() const;
+            void ReadUnlock(const bool locked) const;
+            // returns the mutex to give back, which is nullptr while locking is disabled
+            static SemaphoreHandle_t TakeMutex(SemaphoreHandle_t mutex);
+            static void GiveMutex(SemaphoreHandle_t mutex);
+
+            // CRC-32 (IEEE 802.3), pass the previous result as crc to continue a checksum
+            static uint32_t ComputeHash(const void *data, const uint32_t size, const uint32_t crc = 0);
+            uint32_t ComputeEntryHash(const IndexEntry &entry) const;
+            uint32_t ComputeContentHash() const;
+
+            const IndexEntry *GetEntry(const int32_t keyId) const;
+            const uint8_t *GetValue(const IndexEntry &entry) const
+            {
+                return entry.IsInline() ? entry.inlineValue : _arena.data() + entry.valueOffset;
+            }
+            int32_t FindKey(const char *key, const uint32_t hash) const;
+            // like GetKeyId(), but the id is not handed out, so it may be reused once the key is removed
+            int32_t LookupKey(const char *key, const uint32_t hash) const;
+            int32_t FindId(const char *key, const uint32_t hash) const;
+            uint32_t FindPosition(const char *key) const;
+            void InsertHash(const int32_t keyId);
+            void RebuildHashTable();
+            int32_t AddEntry(const uint32_t hash, const uint32_t keyOffset, const uint32_t valueOffset, const uint32_t valueSize);
+            void RemoveEntry(const int32_t keyId);
+            void RestoreEntry(const int32_t keyId);
+            void RemoveAllEntries();
+            void ReleaseFreeEntries();
+            void StoreValue(IndexEntry &entry, const void *value, const uint32_t valueSize);
+            void IndexValue(IndexEntry &entry, const uint32_t valueOffset, const uint32_t valueSize);
+            int32_t InsertEntry(const char *key, const uint32_t hash, const void *value, const uint32_t valueSize);
+            bool StoreEntry(const int32_t keyId, const void *value, const uint32_t valueSize);
+
+            void LoadShardOf(const uint32_t hash) const;
+            void LoadShardOfKey(const int32_t keyId) const;
+            bool IsShardPending(const uint32_t hash) const;
+            void LoadPendingShards() const;
+            void LoadShard(const uint32_t shard);
+
+            bool IsStaging() const;
+            void StageWrite(const int32_t keyId, const String &key, const void *value, const uint32_t valueSize, const bool remove);
+            bool ApplyTransaction();
+            void EndTransaction();
+            void CompactArena();
+
+            void MarkDirty(const int32_t keyId);
+            void MarkRemoved(const char *key);
+
+            uint32_t ReadBlob(const char *blobName);
+            void EncodeBlob(std::vector<uint8_t> &buffer) const;
+            // compressed points to the compressed entries if they are mapped, they are taken from the arena otherwise
+            bool DecodeBlob(const char *blobName, const uint32_t offset, const uint8_t *compressed, uint32_t compressedSize,
+                            uint8_t &format, uint32_t &entriesOffset);
+            bool ReadChunks(const char *blobName, const bool secondSet, const uint32_t size);
+            static String GetChunkName(const String &blobName, const bool secondSet, const uint32_t index);
+            void IndexBlob(const uint32_t offset, const uint32_t size);
+            void IndexBlobV2(const uint32_t offset, const uint32_t size);
+            void SerializeBlob(std::vector<BlobEntry> &entries, std::vector<uint8_t> &buffer) const;
+            // the live entries of a shard (ALL_SHARDS for all) in the v2 layout without header, passed
+            // to emit piece by piece, so they can be written without building the blob first
+            void SerializeEntries(const uint32_t shard, const std::function<void(const uint8_t *, const uint32_t)> &emit) const;
+            uint32_t GetSerializedSize(const uint32_t shard) const;
+            void PrepareBlob(std::vector<PendingWrite> &writes, const String &blobName, const uint32_t shard);
+            bool StreamBlob(const String &blobName, const std::vector<std::vector<uint8_t>> &chunks, const uint32_t size);
+            void RemoveChunks(const String &blobName, const bool secondSet, const uint32_t firstIndex);
+            static uint32_t EncodeVarint(uint8_t *buffer, uint32_t value);
+            static void WriteVarint(std::vector<uint8_t> &buffer, uint32_t value);
+            bool ReadVarint(const uint32_t endIdx, uint32_t &idx, uint32_t &value) const;
+            static bool ReadVarint(const uint8_t *data, const uint32_t endIdx, uint32_t &idx, uint32_t &value);
+            static bool ReadKeyTable(const uint8_t *data, const uint32_t endIdx, uint32_t &idx, const uint32_t count, std::vector<char> &keys, std::vector<uint32_t> &keyOffsets);
+
+            // collects the writes of a save, called with the save mutex and the data lock held
+            virtual void PrepareSave(std::vector<PendingWrite> &writes);
+
+            // BeginSave() collects the writes under the data lock, EndSave() writes them without any lock
+            void BeginSave(std::vector<PendingWrite> &writes);
+            bool EndSave(std::vector<PendingWrite> &writes);
+            void PrepareSnapshot(std::vector<PendingWrite> &writes);
+            void PrepareLogSegment(std::vector<PendingWrite> &writes);
+            void PrepareShards(std::vector<PendingWrite> &writes);
+            void RemoveLog(std::vector<PendingWrite> &writes);
+            // "logn" holds the number of log segments and which of the two base blobs they apply to
+            const char *GetBaseName() const;
+            uint32_t GetLogCounter() const;
+            void SetLogCounter(const uint32_t counter);
+            void RemoveShards(std::vector<PendingWrite> &writes, const uint32_t firstShard);
+            bool CommitWrites(std::vector<PendingWrite> &writes);
+            void CountWrite(const uint32_t size);
+
+            static void QueueBytes(std::vector<PendingWrite> &writes, const String &key, std::vector<uint8_t> &data);
+            static void QueueUInt(std::vector<PendingWrite> &writes, const String &key, const uint32_t value);
+            static void QueueRemove(std::vector<PendingWrite> &writes, const String &key);
 
         protected:
             String _name;
-            Preferences _pref;
+            PreferencesBackend _preferences;
+            StorageBackend *_backend;
             bool _isLoaded;
             bool _isModified;
-            int32_t _maxKeyId;
-            std::map<String, int32_t> _keys;
-            std::map<int32_t, std::vector<uint8_t>> _values;
+
+            // _dataMutex guards the in-memory state, _saveMutex serializes the flash access
+            SemaphoreHandle_t _dataMutex;
+            SemaphoreHandle_t _saveMutex;
+            // given by the last reader, Lock() waits on it for the active readers
+            SemaphoreHandle_t _readersDone;
+            mutable std::atomic<uint32_t> _readers;
+
+            // keys and values live in one arena, _entries is indexed by the key id and holds every key
+            // that is set or whose id was handed out, _sortedKeys the ids of the keys that are set, ordered
+            // by key, and _hashTable maps the key hashes to all key ids (open addressing, linear probing)
+            std::vector<uint8_t> _arena;
+            std::vector<IndexEntry> _entries;
+            // ids of free entries, the lowest last
+            std::vector<int32_t> _freeIds;
+            std::vector<int32_t> _sortedKeys;
+            std::vector<int32_t> _hashTable;
+            uint32_t _garbage;
+            uint32_t _generation;
+
+            // sum of the entry hashes, so it can be updated for every modified entry on its own
+            uint32_t _contentHash;
+            uint32_t _persistedHash;
+            bool _isPersistedHashValid;
+            bool _isCorrupt;
+            uint32_t _skippedSaves;
+
+            // guarded by the save mutex, the key write counts by the data lock
+            StorageTelemetry _telemetry;
+            uint32_t _savePrepareMicros;
+            bool _countKeyWrites;
+            std::map<String, uint32_t> _keyWriteCounts;
+
+            PersistenceMode _mode;
+            float _compactionRatio;
+            bool _rewritePending;
+            bool _compression;
+            uint32_t _logSegments;
+            uint32_t _logSize;
+            bool _secondBase;
+            std::set<int32_t> _dirtyKeyIds;
+            std::set<String> _removedKeys;
+
+            uint32_t _shardCount;
+            uint32_t _persistedShards;
+            std::vector<bool> _dirtyShards;
+
+            // shards not read by a lazy Reload() yet
+            bool _lazyLoading;
+            std::vector<bool> _pendingShards;
+            std::atomic<uint32_t> _pendingShardCount;
+
+            bool _inTransaction;
+            bool _transactionFailed;
+            TaskHandle_t _transactionOwner;
+            std::vector<StagedWrite> _transaction;
         };
     }
 }
\ No newline at end of file
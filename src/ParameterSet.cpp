@@ -1,43 +1,576 @@
 #include "ParameterSet.h"
+#include "HeapStats.h"
+#include <algorithm>
+
+#define SNAPSHOT_IMAGE_KEY "snapshot"
+
+// _keySlots entries of keys which were not looked up yet and of keys without parameter
+#define SLOT_UNKNOWN -1
+#define SLOT_NONE -2
 
 namespace esp32
 {
     namespace foundation
     {
         ParameterSet::ParameterSet(const String& name)
-            : KeyValueStorage(name)
+            : KeyValueStorage(name),
+              _snapshot(nullptr),
+              _snapshotReaders(0),
+              _fastLoad(false),
+              _hasChanges(false),
+              _nextSubscriptionId(1),
+              _autoSaveTask(nullptr),
+              _autoSaveStop(false),
+              _autoSaveDirty(false),
+              _quietPeriod(0),
+              _maxLatency(0),
+              _firstModification(0),
+              _lastModification(0)
         {
         }
 
         ParameterSet::~ParameterSet()
         {
+            DisableAutoSave();
+
+            delete _snapshot.load();
+            for (auto *snapshot : _retiredSnapshots)
+            {
+                delete snapshot;
+            }
+        }
+
+        uint32_t ParameterSet::Reload()
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            const uint32_t result = KeyValueStorage::Reload();
+
+            // the snapshot contains every value, so the shards of a lazy reload are read right away,
+            // before the data lock is taken
+            LoadPendingShards();
+            ScopedLock lock(*this);
+            RebuildSnapshot();
+            return result;
+        }
+
+        void ParameterSet::PrepareSave(std::vector<PendingWrite> &writes)
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            {
+                // both sequences are sorted by name, so the unused keys can be found in one pass
+                ScopedLock lock(*this);
+                std::vector<int32_t> garbage;
+                auto paramIt = _params.begin();
+                for (const int32_t keyId : _sortedKeys)
+                {
+                    const char *key = GetKey(keyId);
+                    while (paramIt != _params.end() && strcmp(paramIt->first.c_str(), key) < 0)
+                    {
+                        ++paramIt;
+                    }
+                    if (paramIt == _params.end() || strcmp(paramIt->first.c_str(), key) != 0)
+                    {
+                        garbage.push_back(keyId);
+                    }
+                }
+                for (const int32_t keyId : garbage)
+                {
+                    Unset(keyId);
+                }
+            }
+
+            KeyValueStorage::PrepareSave(writes);
+            if (_fastLoad && !writes.empty())
+            {
+                QueueSnapshotImage(writes);
+            }
+        }
+
+        bool ParameterSet::IsExported(const char *key) const
+        {
+            // hidden parameters, e.g. credentials, stay on the device like in PrintParameters()
+            return key[0] != '.';
+        }
+
+        void ParameterSet::QueueSnapshotImage(std::vector<PendingWrite> &writes)
+        {
+            // called with the data lock held, after the checksum of the saved content is known
+            UpdateSnapshot();
+            const ParameterSnapshot *snapshot = _snapshot.load();
+
+            SnapshotImageHeader header;
+            header.SchemaHash = ComputeSchemaHash();
+            header.ContentHash = _contentHash;
+            header.Count = _params.size();
+
+            std::vector<uint8_t> image(sizeof(SnapshotImageHeader) + header.Count * sizeof(ParameterSnapshot::Value));
+            memcpy(image.data(), &header, sizeof(SnapshotImageHeader));
+            ParameterSnapshot::Value *values = (ParameterSnapshot::Value *)(image.data() + sizeof(SnapshotImageHeader));
+            for (auto &param : _params)
+            {
+                *values++ = snapshot->Values[param.second->_slot].Read();
+            }
+            QueueBytes(writes, SNAPSHOT_IMAGE_KEY, image);
+        }
+
+        bool ParameterSet::LoadSnapshotImage()
+        {
+            // requires the save mutex and the data lock
+            SnapshotImageHeader header;
+            std::vector<uint8_t> image;
+            uint32_t contentHash = 0;
+            if (_backend->Begin(_name.c_str(), true))
+            {
+                contentHash = _backend->ReadUInt("crc", 0);
+                image.resize(_backend->GetSize(SNAPSHOT_IMAGE_KEY));
+                if (image.size() >= sizeof(SnapshotImageHeader) && _backend->Read(SNAPSHOT_IMAGE_KEY, image.data(), image.size()) != image.size())
+                {
+                    image.clear();
+                }
+                _backend->End();
+            }
+
+            // the image is only valid for the content it was saved with and the same parameters
+            if (image.size() < sizeof(SnapshotImageHeader))
+            {
+                return false;
+            }
+            memcpy(&header, image.data(), sizeof(SnapshotImageHeader));
+            if (header.ContentHash != contentHash || header.Count != _params.size() ||
+                image.size() != sizeof(SnapshotImageHeader) + header.Count * sizeof(ParameterSnapshot::Value) ||
+                header.SchemaHash != ComputeSchemaHash())
+            {
+                return false;
+            }
+
+            ParameterSnapshot *snapshot = new ParameterSnapshot(_slots.size());
+            const uint8_t *values = image.data() + sizeof(SnapshotImageHeader);
+            for (auto &param : _params)
+            {
+                ParameterSnapshot::Value value;
+                memcpy(&value, values, sizeof(ParameterSnapshot::Value));
+                snapshot->Values[param.second->_slot].Write(value);
+                values += sizeof(ParameterSnapshot::Value);
+            }
+            PublishSnapshot(snapshot);
+            return true;
+        }
+
+        void ParameterSet::LoadSnapshot()
+        {
+            if (!IsLoaded() && _fastLoad)
+            {
+                bool published = false;
+                const SemaphoreHandle_t saveMutex = TakeMutex(_saveMutex);
+                {
+                    ScopedLock lock(*this);
+                    const ParameterSnapshot *snapshot = _snapshot.load();
+                    if (!IsLoaded())
+                    {
+                        // another reader may have published the image in the meantime
+                        published = (snapshot != nullptr && snapshot->Values.size() == _slots.size()) || LoadSnapshotImage();
+                    }
+                }
+                GiveMutex(saveMutex);
+                if (published)
+                {
+                    return;
+                }
+            }
+
+            Load();
+            UpdateSnapshot();
+        }
+
+        void ParameterSet::SetFastLoad(const bool enabled)
+        {
+            _fastLoad = enabled;
+        }
+
+        bool ParameterSet::IsFastLoadEnabled() const
+        {
+            return _fastLoad;
+        }
+
+        uint32_t ParameterSet::ComputeSchemaHash() const
+        {
+            // the values of the image are ordered by name, so the order of registration does not matter
+            uint32_t hash = 0;
+            for (auto &param : _params)
+            {
+                const uint8_t type = param.second->Type;
+                hash = ComputeHash(param.first.c_str(), param.first.length() + 1, hash);
+                hash = ComputeHash(&type, sizeof(type), hash);
+            }
+            return hash;
+        }
+
+        void ParameterSet::EnableAutoSave(const uint32_t quietPeriodInMillis, const uint32_t maxLatencyInMillis)
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            EnableLocking();
+            {
+                ScopedLock lock(*this);
+                _quietPeriod = quietPeriodInMillis;
+                _maxLatency = std::max(quietPeriodInMillis, maxLatencyInMillis);
+                if (IsModified() && !_autoSaveDirty)
+                {
+                    _autoSaveDirty = true;
+                    _firstModification = _lastModification = millis();
+                }
+            }
+
+            if (_autoSaveTask == nullptr)
+            {
+                xTaskCreate(AutoSaveTask, "AutoSave", 4096, this, 1, &_autoSaveTask);
+            }
+            else
+            {
+                // apply the new timing
+                xTaskNotifyGive(_autoSaveTask);
+            }
+        }
+
+        void ParameterSet::DisableAutoSave()
+        {
+            if (_autoSaveTask != nullptr)
+            {
+                _autoSaveStop = true;
+                xTaskNotifyGive(_autoSaveTask);
+
+                // the task resets the flag right before it terminates
+                while (_autoSaveStop)
+                {
+                    delay(1);
+                }
+                _autoSaveTask = nullptr;
+                Flush();
+            }
+        }
+
+        bool ParameterSet::IsAutoSaveEnabled() const
+        {
+            return _autoSaveTask != nullptr;
+        }
+
+        void ParameterSet::Flush()
+        {
+            {
+                ScopedLock lock(*this);
+                _autoSaveDirty = false;
+            }
+            Save();
+        }
+
+        void ParameterSet::OnModified(const int32_t keyId)
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            // before the first load the readers take the slow path, which loads the set
+            if (IsLoaded())
+            {
+                UpdateSnapshot(keyId);
+            }
+
+            if (_autoSaveTask != nullptr)
+            {
+                _lastModification = millis();
+                if (!_autoSaveDirty)
+                {
+                    // the task sleeps until the first modification
+                    _autoSaveDirty = true;
+                    _firstModification = _lastModification;
+                    xTaskNotifyGive(_autoSaveTask);
+                }
+            }
+        }
+
+        void ParameterSet::AutoSaveTask(void *arg)
+        {
+            ParameterSet *self = (ParameterSet *)arg;
+            while (!self->_autoSaveStop)
+            {
+                TickType_t wait = portMAX_DELAY;
+                bool save = false;
+                {
+                    ScopedLock lock(*self);
+                    if (self->_autoSaveDirty)
+                    {
+                        const uint32_t now = millis();
+                        const uint32_t quiet = now - self->_lastModification;
+                        const uint32_t latency = now - self->_firstModification;
+                        if (quiet >= self->_quietPeriod || latency >= self->_maxLatency)
+                        {
+                            self->_autoSaveDirty = false;
+                            save = true;
+                        }
+                        else
+                        {
+                            wait = pdMS_TO_TICKS(std::min(self->_quietPeriod - quiet, self->_maxLatency - latency)) + 1;
+                        }
+                    }
+                }
+
+                if (save)
+                {
+                    // only the in-memory part of the save holds the data lock
+                    self->Save();
+                }
+                else
+                {
+                    ulTaskNotifyTake(pdTRUE, wait);
+                }
+            }
+
+            self->_autoSaveStop = false;
+            vTaskDelete(nullptr);
+        }
+
+        void ParameterSet::UpdateSnapshot()
+        {
+            ScopedLock lock(*this);
+            const ParameterSnapshot *snapshot = _snapshot.load();
+            if (snapshot == nullptr || snapshot->Values.size() != _slots.size())
+            {
+                RebuildSnapshot();
+            }
+        }
+
+        void ParameterSet::UpdateSnapshot(const int32_t keyId)
+        {
+            ParameterSnapshot *snapshot = _snapshot.load();
+            if (snapshot == nullptr || snapshot->Values.size() != _slots.size() || GetEntry(keyId) == nullptr)
+            {
+                // Clear(), Unset() or new parameters
+                RebuildSnapshot();
+                return;
+            }
+
+            // the modified value is replaced in place
+            const int32_t slot = FindSlot(keyId);
+            if (slot >= 0)
+            {
+                ParameterSnapshot::Value value;
+                ReadSnapshotValue(keyId, value);
+                const ParameterSnapshot::Value previous = snapshot->Values[slot].Read();
+                if (value.Data != previous.Data || value.Size != previous.Size)
+                {
+                    snapshot->Values[slot].Write(value);
+                    MarkChanged(slot);
+                }
+            }
+        }
+
+        int32_t ParameterSet::FindSlot(const int32_t keyId)
+        {
+            // keys set after the last rebuild are looked up by name once
+            if (keyId >= (int32_t)_keySlots.size())
+            {
+                _keySlots.resize(keyId + 1, SLOT_UNKNOWN);
+            }
+            if (_keySlots[keyId] == SLOT_UNKNOWN)
+            {
+                auto it = _params.find(GetKey(keyId));
+                _keySlots[keyId] = it != _params.end() ? it->second->_slot : SLOT_NONE;
+            }
+            return _keySlots[keyId];
+        }
+
+        void ParameterSet::RebuildSnapshot()
+        {
+            _keySlots.clear();
+            ParameterSnapshot *snapshot = new ParameterSnapshot(_slots.size());
+            for (uint32_t slot = 0; slot < _slots.size(); slot++)
+            {
+                if (_slots[slot] != nullptr)
+                {
+                    // called with the data lock held, so the lookup must not read a shard
+                    const char *name = _slots[slot]->Name.c_str();
+                    const int32_t keyId = FindKey(name, HashKey(name));
+                    if (keyId > -1)
+                    {
+                        _keySlots.resize(std::max<uint32_t>(_keySlots.size(), keyId + 1), SLOT_UNKNOWN);
+                        _keySlots[keyId] = slot;
+                    }
+
+                    ParameterSnapshot::Value value;
+                    ReadSnapshotValue(keyId, value);
+                    snapshot->Values[slot].Write(value);
+                }
+            }
+            PublishSnapshot(snapshot);
+        }
+
+        void ParameterSet::PublishSnapshot(ParameterSnapshot *snapshot)
+        {
+            ParameterSnapshot *previous = _snapshot.exchange(snapshot);
+            if (previous != nullptr)
+            {
+                MarkChanges(previous, snapshot);
+                _retiredSnapshots.push_back(previous);
+            }
+
+            // readers which start from now on only see the new snapshot, so the retired ones
+            // can be deleted as soon as no reader is active, otherwise with the next update
+            if (_snapshotReaders == 0)
+            {
+                for (auto *retired : _retiredSnapshots)
+                {
+                    delete retired;
+                }
+                _retiredSnapshots.clear();
+            }
+        }
+
+        void ParameterSet::MarkChanges(const ParameterSnapshot *previous, const ParameterSnapshot *current)
+        {
+            // comparing the snapshots also finds the changes made by Clear(), Commit() and Reload()
+            const uint32_t count = std::min(previous->Values.size(), current->Values.size());
+            for (uint32_t slot = 0; slot < count; slot++)
+            {
+                const ParameterSnapshot::Value a = previous->Values[slot].Read();
+                const ParameterSnapshot::Value b = current->Values[slot].Read();
+                if (a.Data != b.Data || a.Size != b.Size)
+                {
+                    MarkChanged(slot);
+                }
+            }
+        }
+
+        void ParameterSet::MarkChanged(const uint32_t slot)
+        {
+            if (slot / 32 >= _changedSlots.size())
+            {
+                _changedSlots.resize(slot / 32 + 1, 0);
+            }
+            _changedSlots[slot / 32] |= 1u << (slot % 32);
+            _hasChanges = true;
+        }
+
+        void ParameterSet::ReadSnapshotValue(const int32_t keyId, ParameterSnapshot::Value &value) const
+        {
+            value.Data = 0;
+            value.Size = 0;
+
+            const IndexEntry *entry = GetEntry(keyId);
+            if (entry != nullptr)
+            {
+                const uint8_t *data = GetValue(*entry);
+                if (entry->valueSize <= sizeof(value.Data))
+                {
+                    memcpy(&value.Data, data, entry->valueSize);
+                }
+                else
+                {
+                    value.Data = ComputeHash(data, entry->valueSize);
+                }
+                value.Size = entry->valueSize;
+            }
+        }
+
+        uint32_t ParameterSet::Subscribe(Parameter &parameter, std::function<void(Parameter &)> callback)
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            ScopedLock lock(*this);
+            _subscriptions.push_back({_nextSubscriptionId, &parameter, String(), callback});
+            return _nextSubscriptionId++;
+        }
+
+        uint32_t ParameterSet::Subscribe(const String &prefix, std::function<void(Parameter &)> callback)
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            ScopedLock lock(*this);
+            _subscriptions.push_back({_nextSubscriptionId, nullptr, prefix, callback});
+            return _nextSubscriptionId++;
+        }
+
+        void ParameterSet::Unsubscribe(const uint32_t subscriptionId)
+        {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            ScopedLock lock(*this);
+            for (auto it = _subscriptions.begin(); it != _subscriptions.end(); ++it)
+            {
+                if (it->Id == subscriptionId)
+                {
+                    _subscriptions.erase(it);
+                    return;
+                }
+            }
         }
 
-        void ParameterSet::Save()
+        uint32_t ParameterSet::DispatchChanges()
         {
-            std::vector<String> garbage;
-            for (auto &key : _keys)
+            if (!_hasChanges)
+            {
+                return 0;
+            }
+
+            // collect the modified parameters and their callbacks, then invoke them without the lock,
+            // so the callbacks are free to modify the set
+            std::vector<std::pair<Parameter *, std::function<void(Parameter &)>>> calls;
+            uint32_t count = 0;
             {
-                if (_params.find(key.first) == _params.end())
+                HeapScope heapScope(HS_PARAMETER_SET);
+                ScopedLock lock(*this);
+                _hasChanges = false;
+                for (uint32_t word = 0; word < _changedSlots.size(); word++)
                 {
-                    garbage.push_back(key.first);
+                    uint32_t bits = _changedSlots[word];
+                    _changedSlots[word] = 0;
+                    while (bits != 0)
+                    {
+                        const uint32_t slot = word * 32 + __builtin_ctz(bits);
+                        bits &= bits - 1;
+
+                        Parameter *parameter = slot < _slots.size() ? _slots[slot] : nullptr;
+                        if (parameter == nullptr)
+                        {
+                            continue;
+                        }
+
+                        count++;
+                        for (auto &subscription : _subscriptions)
+                        {
+                            if (subscription.Param == parameter ||
+                                (subscription.Param == nullptr && parameter->Name.startsWith(subscription.Prefix)))
+                            {
+                                calls.push_back(std::make_pair(parameter, subscription.Callback));
+                            }
+                        }
+                    }
                 }
             }
-            for (auto &name : garbage)
+
+            for (auto &call : calls)
             {
-                Unset(name);
+                call.second(*call.first);
             }
-            KeyValueStorage::Save();
+            return count;
         }
 
         void ParameterSet::Register(Parameter &parameter)
         {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            ScopedLock lock(*this);
+            // slots are never reused, the snapshot grows with the next update
             _params[parameter.Name] = &parameter;
+            parameter._slot = _slots.size();
+            _slots.push_back(&parameter);
         }
 
         void ParameterSet::Unregister(Parameter &parameter)
         {
+            HeapScope heapScope(HS_PARAMETER_SET);
+            ScopedLock lock(*this);
             _params.erase(parameter.Name);
+            if (parameter._slot >= 0)
+            {
+                _slots[parameter._slot] = nullptr;
+            }
+
+            for (auto it = _subscriptions.begin(); it != _subscriptions.end();)
+            {
+                it = it->Param == &parameter ? _subscriptions.erase(it) : it + 1;
+            }
         }
 
         Parameter *ParameterSet::GetParameter(const String &name) const
@@ -81,7 +614,8 @@ namespace esp32
             : Type(type),
                 Name(name),
                 ParamSet(paramSet),
-                _keyId(-1)
+                _keyId(-1),
+                _slot(-1)
         {
             ParamSet.Register(*this);
         }
@@ -136,19 +670,33 @@ namespace esp32
             return (String)(*this);
         }
 
-        StringParameter::operator String()
+        const char *StringParameter::c_str()
         {
             ParamSet.Load();
 
             if (_keyId < 0)
                 _keyId = ParamSet.GetKeyId(Name);
 
+            ValueView val;
+            if (_keyId < 0 || !ParamSet.GetView(_keyId, val) || val.Size() == 0 || val.Data()[val.Size() - 1] != 0)
+                return DefaultValue.c_str();
+
+            return (const char *)val.Data();
+        }
+
+        StringParameter::operator String()
+        {
+            ParamSet.Load();
+
             if (_keyId < 0)
-                return DefaultValue;
+                _keyId = ParamSet.GetKeyId(Name);
 
+            // copied while the set is locked, another task may modify it right after
             std::vector<uint8_t> val;
-            ParamSet.Get(_keyId, val);
-            return String((char *)val.data());
+            if (_keyId < 0 || !ParamSet.Get(_keyId, val) || val.empty() || val.back() != 0)
+                return DefaultValue;
+
+            return String((const char *)val.data());
         }
 
         StringParameter &StringParameter::operator=(const String &value)
@@ -157,7 +705,9 @@ namespace esp32
 
             if (_keyId < 0)
             {
-                _keyId = ParamSet.Set(Name, value.c_str(), value.length() + 1);
+                // only the ids of GetKeyId() stay valid when the key is removed
+                ParamSet.Set(Name, value.c_str(), value.length() + 1);
+                _keyId = ParamSet.GetKeyId(Name);
             }
             else
             {
@@ -182,17 +732,12 @@ namespace esp32
 
         FloatParameter::operator float()
         {
-            ParamSet.Load();
-
-            if (_keyId < 0)
-                _keyId = ParamSet.GetKeyId(Name);
-
-            if (_keyId < 0)
-                return DefaultValue;
-
             auto result = DefaultValue;
-            ParamSet.Get(_keyId, result);
-
+            if (!ParamSet.ReadSnapshot(_slot, result))
+            {
+                ParamSet.LoadSnapshot();
+                ParamSet.ReadSnapshot(_slot, result);
+            }
             return result;
         }
 
@@ -203,7 +748,8 @@ namespace esp32
             const auto val = constrain(value, MinValue, MaxValue);
             if (_keyId < 0)
             {
-                _keyId = ParamSet.Set(Name, val);
+                ParamSet.Set(Name, val);
+                _keyId = ParamSet.GetKeyId(Name);
             }
             else
             {
@@ -228,17 +774,12 @@ namespace esp32
 
         IntegerParameter::operator int32_t()
         {
-            ParamSet.Load();
-
-            if (_keyId < 0)
-                _keyId = ParamSet.GetKeyId(Name);
-
-            if (_keyId < 0)
-                return DefaultValue;
-
             auto result = DefaultValue;
-            ParamSet.Get(_keyId, result);
-
+            if (!ParamSet.ReadSnapshot(_slot, result))
+            {
+                ParamSet.LoadSnapshot();
+                ParamSet.ReadSnapshot(_slot, result);
+            }
             return result;
         }
 
@@ -249,7 +790,8 @@ namespace esp32
             const auto val = constrain(value, MinValue, MaxValue);
             if (_keyId < 0)
             {
-                _keyId = ParamSet.Set(Name, val);
+                ParamSet.Set(Name, val);
+                _keyId = ParamSet.GetKeyId(Name);
             }
             else
             {
@@ -291,17 +833,12 @@ namespace esp32
 
         BooleanParameter::operator bool()
         {
-            ParamSet.Load();
-
-            if (_keyId < 0)
-                _keyId = ParamSet.GetKeyId(Name);
-
-            if (_keyId < 0)
-                return DefaultValue;
-
             auto result = DefaultValue;
-            ParamSet.Get(_keyId, result);
-
+            if (!ParamSet.ReadSnapshot(_slot, result))
+            {
+                ParamSet.LoadSnapshot();
+                ParamSet.ReadSnapshot(_slot, result);
+            }
             return result;
         }
 
@@ -311,7 +848,8 @@ namespace esp32
 
             if (_keyId < 0)
             {
-                _keyId = ParamSet.Set(Name, value);
+                ParamSet.Set(Name, value);
+                _keyId = ParamSet.GetKeyId(Name);
             }
             else
             {
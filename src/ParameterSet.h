@@ -1,6 +1,8 @@
 #pragma once
 #include "KeyValueStorage.h"
 #include <map>
+#include <functional>
+#include <freertos/task.h>
 
 namespace esp32
 {
@@ -8,13 +10,79 @@ namespace esp32
     {
         struct Parameter;
 
+        // copy of the values of all parameters, indexed by the parameter slot. A modification replaces
+        // its value in place, new parameters, Clear(), Unset() and Reload() publish a new snapshot.
+        // Data holds values of up to 4 bytes and the checksum of larger ones, Size is 0 for unset values.
+        struct ParameterSnapshot
+        {
+            struct Value
+            {
+                uint32_t Data;
+                uint32_t Size;
+            };
+
+            // Holds two copies of the value, the generation selects the current one. The writer fills the
+            // other copy before it switches, a reader retries if the generation changed while it copied,
+            // so readers never wait for a preempted writer.
+            struct Slot
+            {
+                std::atomic<uint32_t> Generation;
+                std::atomic<uint32_t> Data[2];
+                std::atomic<uint32_t> Size[2];
+
+                Value Read() const
+                {
+                    Value value;
+                    uint32_t generation = Generation.load();
+                    while (true)
+                    {
+                        value.Data = Data[generation & 1].load();
+                        value.Size = Size[generation & 1].load();
+                        const uint32_t current = Generation.load();
+                        if (current == generation)
+                        {
+                            return value;
+                        }
+                        generation = current;
+                    }
+                }
+
+                // writers hold the data lock
+                void Write(const Value &value)
+                {
+                    const uint32_t generation = Generation.load() + 1;
+                    Data[generation & 1] = value.Data;
+                    Size[generation & 1] = value.Size;
+                    Generation = generation;
+                }
+            };
+
+            // the slots are zero-initialized, i.e. unset
+            ParameterSnapshot(const uint32_t count) : Values(count)
+            {
+            }
+
+            std::vector<Slot> Values;
+        };
+
         class ParameterSet : public KeyValueStorage
         {
         public:
             ParameterSet(const String& name);
             virtual ~ParameterSet();
 
-            virtual void Save() override;
+            virtual uint32_t Reload() override;
+
+            // Saves in a background task once no parameter was modified for quietPeriodInMillis,
+            // but no later than maxLatencyInMillis after the first unsaved modification.
+            void EnableAutoSave(
+                const uint32_t quietPeriodInMillis = 1000,
+                const uint32_t maxLatencyInMillis = 10000);
+            void DisableAutoSave();
+            bool IsAutoSaveEnabled() const;
+
+            // saves pending modifications immediately, e.g. before a restart
+            void Flush();
 
             void Register(Parameter &parameter);
             void Unregister(Parameter &parameter);
@@ -22,10 +90,119 @@ namespace esp32
             Parameter *GetParameter(const String &name) const;
             const std::map<String, Parameter *> &GetParameters() const;
 
+            // Reads a value from the published snapshot without locking. Returns false if the
+            // snapshot does not contain the slot yet, result is left unchanged if the value is unset.
+            template <typename T>
+            bool ReadSnapshot(const int32_t slot, T &result) const
+            {
+                static_assert(sizeof(T) <= sizeof(uint32_t), "type does not fit into a snapshot value");
+
+                // retired snapshots are only deleted while no reader is active
+                _snapshotReaders++;
+                const ParameterSnapshot *snapshot = _snapshot.load();
+                const bool found = snapshot != nullptr && slot >= 0 && slot < (int32_t)snapshot->Values.size();
+                if (found)
+                {
+                    const ParameterSnapshot::Value value = snapshot->Values[slot].Read();
+                    if (value.Size == sizeof(T))
+                    {
+                        memcpy(&result, &value.Data, sizeof(T));
+                    }
+                }
+                _snapshotReaders--;
+                return found;
+            }
+
+            // publishes a new snapshot if the current one does not contain all registered parameters
+            void UpdateSnapshot();
+
+            // called by the readers if their slot is missing: publishes the snapshot image of the last save
+            // if it was written for the same parameters, otherwise loads the set and updates the snapshot
+            void LoadSnapshot();
+
+            // Every save also writes the values of the snapshot, which let the readers start before the set
+            // is loaded. The set is loaded by the first write or string access then. Disabled by default,
+            // the image is rewritten as a whole by every save, also by the small ones of PM_LOG and PM_SHARDED.
+            void SetFastLoad(const bool enabled);
+            bool IsFastLoadEnabled() const;
+
+            // hash of the names and types of the registered parameters
+            uint32_t ComputeSchemaHash() const;
+
+            // The callback is invoked by DispatchChanges() if the parameter, or any parameter whose
+            // name starts with prefix, was modified. Returns the id to unsubscribe.
+            uint32_t Subscribe(Parameter &parameter, std::function<void(Parameter &)> callback);
+            uint32_t Subscribe(const String &prefix, std::function<void(Parameter &)> callback);
+            void Unsubscribe(const uint32_t subscriptionId);
+
+            // invokes the callbacks for the parameters modified since the last call in the context of
+            // the calling task, e.g. once per loop(), returns the number of modified parameters
+            uint32_t DispatchChanges();
+
             void PrintParameters(HardwareSerial& serial, const bool hiddenParams = false) const;
 
+        protected:
+            virtual void OnModified(const int32_t keyId) override;
+            virtual void PrepareSave(std::vector<PendingWrite> &writes) override;
+            virtual bool IsExported(const char *key) const override;
+
+        private:
+            // prefix of the persisted snapshot image, followed by the values of all parameters ordered by name
+            struct SnapshotImageHeader
+            {
+                uint32_t SchemaHash;
+                uint32_t ContentHash;
+                uint32_t Count;
+            };
+
+            struct Subscription
+            {
+                uint32_t Id;
+                Parameter *Param;
+                String Prefix;
+                std::function<void(Parameter &)> Callback;
+            };
+
+            static void AutoSaveTask(void *arg);
+
+            // writers hold the data lock
+            void RebuildSnapshot();
+            void UpdateSnapshot(const int32_t keyId);
+            void PublishSnapshot(ParameterSnapshot *snapshot);
+            void MarkChanges(const ParameterSnapshot *previous, const ParameterSnapshot *current);
+            void MarkChanged(const uint32_t slot);
+            void ReadSnapshotValue(const int32_t keyId, ParameterSnapshot::Value &value) const;
+            int32_t FindSlot(const int32_t keyId);
+            bool LoadSnapshotImage();
+            void QueueSnapshotImage(std::vector<PendingWrite> &writes);
+
         private:
             std::map<String, Parameter *> _params;
+            std::vector<Parameter *> _slots;
+            // slot of the parameter of each key id, cleared by RebuildSnapshot(), which is also called
+            // whenever key ids may be reused
+            std::vector<int32_t> _keySlots;
+
+            std::atomic<ParameterSnapshot *> _snapshot;
+            mutable std::atomic<uint32_t> _snapshotReaders;
+            std::vector<ParameterSnapshot *> _retiredSnapshots;
+            bool _fastLoad;
+
+            // one bit per parameter slot, set by the writers and drained by DispatchChanges(). Slots rather than
+            // key ids, the changes are found in the snapshot, which is indexed by slot, and a parameter whose
+            // key was never set has no key id.
+            std::vector<uint32_t> _changedSlots;
+            std::atomic<bool> _hasChanges;
+            std::vector<Subscription> _subscriptions;
+            uint32_t _nextSubscriptionId;
+
+            TaskHandle_t _autoSaveTask;
+            std::atomic<bool> _autoSaveStop;
+            bool _autoSaveDirty;
+            uint32_t _quietPeriod;
+            uint32_t _maxLatency;
+            uint32_t _firstModification;
+            uint32_t _lastModification;
         };
 
         extern ParameterSet DefaultParameterSet;
@@ -52,7 +229,10 @@ namespace esp32
             String GetDisplayName() const;
 
         protected:
+            friend class ParameterSet;
+
             int32_t _keyId;
+            int32_t _slot;
 
             Parameter(
                 const ParameterType type,
@@ -76,6 +256,10 @@ namespace esp32
             virtual void SetFromString(const String& value) override;
             virtual String ToString() override;
 
+            // points into the parameter set, valid until the set is modified,
+            // use the String conversion if other tasks may modify the set
+            const char *c_str();
+
             operator String();
             StringParameter &operator=(const String &value);
         };
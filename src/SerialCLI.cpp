@@ -1,5 +1,6 @@
 #include "SerialCLI.h"
 #include "StringUtils.h"
+#include "HeapStats.h"
 
 #define MAX_BUFFER_SIZE 1024
 
@@ -10,6 +11,7 @@ namespace esp32
         SerialCLI::SerialCLI(HardwareSerial &serial)
             : _serial(serial)
         {
+            HeapScope heapScope(HS_SERIAL_CLI);
             _buffer.reserve(128);
         }
 
@@ -42,6 +44,7 @@ namespace esp32
             std::function<bool()> handler,
             const String &description)
         {
+            HeapScope heapScope(HS_SERIAL_CLI);
             _handlers[cmd] = SerialInputHandler([handler](const String& arg) -> bool
             {
                 return handler();
@@ -53,6 +56,7 @@ namespace esp32
             std::function<bool(const String &arg)> handler,
             const String &description)
         {
+            HeapScope heapScope(HS_SERIAL_CLI);
             _handlers[cmd] = SerialInputHandler(handler, description);
         }
 
@@ -61,6 +65,7 @@ namespace esp32
             std::function<bool(const String &arg0, const String &arg1)> handler,
             const String &description)
         {
+            HeapScope heapScope(HS_SERIAL_CLI);
             _handlers[cmd] = SerialInputHandler([handler](const String& arg) -> bool
             {
                 String arg0, arg1;
@@ -96,6 +101,7 @@ namespace esp32
 
         bool SerialCLI::ReadCommand(String &cmd, String &arg)
         {
+            HeapScope heapScope(HS_SERIAL_CLI);
             cmd = "";
             arg = "";
             while (_serial.available())
@@ -128,7 +134,7 @@ namespace esp32
                         _buffer.remove(_buffer.length() - 1, 1);
                     }
                 }
-                else if ((c >= 0x20 && c <= 0x7E) || (c >= 0xA0 && c <= 0xFF)) // printable chars
+                else if ((c >= 0x20 && c <= 0x7E) || (uint8_t)c >= 0xA0) // printable chars, char may be signed
                 {
                     _serial.print(c);
                     _buffer += c;
@@ -0,0 +1,477 @@
+#include "StorageBackend.h"
+#ifndef ARDUINO
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace esp32
+{
+    namespace foundation
+    {
+        bool StorageBackend::SupportsPartialWrite() const
+        {
+            return false;
+        }
+
+        uint32_t StorageBackend::WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size)
+        {
+            return 0;
+        }
+
+        const uint8_t *StorageBackend::Map(const char *key, uint32_t &size)
+        {
+            size = 0;
+            return nullptr;
+        }
+
+        bool PreferencesBackend::Begin(const char *name, const bool readOnly)
+        {
+            return _pref.begin(name, readOnly);
+        }
+
+        void PreferencesBackend::End()
+        {
+            _pref.end();
+        }
+
+        bool PreferencesBackend::Exists(const char *key)
+        {
+            return _pref.isKey(key);
+        }
+
+        uint32_t PreferencesBackend::GetSize(const char *key)
+        {
+            return _pref.getBytesLength(key);
+        }
+
+        uint32_t PreferencesBackend::Read(const char *key, void *data, const uint32_t size)
+        {
+            return _pref.getBytes(key, data, size);
+        }
+
+        uint32_t PreferencesBackend::Write(const char *key, const void *data, const uint32_t size)
+        {
+            return _pref.putBytes(key, data, size);
+        }
+
+        uint32_t PreferencesBackend::ReadUInt(const char *key, const uint32_t defaultValue)
+        {
+            return _pref.getUInt(key, defaultValue);
+        }
+
+        bool PreferencesBackend::WriteUInt(const char *key, const uint32_t value)
+        {
+            return _pref.putUInt(key, value) == sizeof(uint32_t);
+        }
+
+        bool PreferencesBackend::Remove(const char *key)
+        {
+            return _pref.remove(key);
+        }
+
+        RamBackend::RamBackend() :
+            _current(nullptr),
+            _readOnly(true)
+        {
+        }
+
+        bool RamBackend::Begin(const char *name, const bool readOnly)
+        {
+            // like Preferences, a namespace that was never written cannot be opened read-only
+            if (readOnly && _namespaces.find(name) == _namespaces.end())
+            {
+                return false;
+            }
+            _current = &_namespaces[name];
+            _readOnly = readOnly;
+            return true;
+        }
+
+        void RamBackend::End()
+        {
+            _current = nullptr;
+        }
+
+        bool RamBackend::Exists(const char *key)
+        {
+            return Find(key) != nullptr;
+        }
+
+        uint32_t RamBackend::GetSize(const char *key)
+        {
+            const std::vector<uint8_t> *value = Find(key);
+            return value != nullptr ? value->size() : 0;
+        }
+
+        uint32_t RamBackend::Read(const char *key, void *data, const uint32_t size)
+        {
+            const std::vector<uint8_t> *value = Find(key);
+            if (value == nullptr || value->size() > size)
+            {
+                return 0;
+            }
+            memcpy(data, value->data(), value->size());
+            return value->size();
+        }
+
+        uint32_t RamBackend::Write(const char *key, const void *data, const uint32_t size)
+        {
+            return WriteAt(key, 0, data, size);
+        }
+
+        uint32_t RamBackend::ReadUInt(const char *key, const uint32_t defaultValue)
+        {
+            uint32_t value = defaultValue;
+            if (GetSize(key) == sizeof(uint32_t))
+            {
+                Read(key, &value, sizeof(uint32_t));
+            }
+            return value;
+        }
+
+        bool RamBackend::WriteUInt(const char *key, const uint32_t value)
+        {
+            return Write(key, &value, sizeof(uint32_t)) == sizeof(uint32_t);
+        }
+
+        bool RamBackend::Remove(const char *key)
+        {
+            return _current != nullptr && !_readOnly && _current->erase(key) > 0;
+        }
+
+        bool RamBackend::SupportsPartialWrite() const
+        {
+            return true;
+        }
+
+        uint32_t RamBackend::WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size)
+        {
+            if (_current == nullptr || _readOnly)
+            {
+                return 0;
+            }
+
+            std::vector<uint8_t> &value = (*_current)[key];
+            if (offset != 0 && offset != value.size())
+            {
+                return 0;
+            }
+            value.resize(offset);
+            value.insert(value.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+            return size;
+        }
+
+        uint32_t RamBackend::GetUsedBytes() const
+        {
+            uint32_t size = 0;
+            for (auto &name : _namespaces)
+            {
+                for (auto &entry : name.second)
+                {
+                    size += entry.first.length() + entry.second.size();
+                }
+            }
+            return size;
+        }
+
+        const std::vector<uint8_t> *RamBackend::Find(const char *key) const
+        {
+            if (_current == nullptr)
+            {
+                return nullptr;
+            }
+            auto it = _current->find(key);
+            return it != _current->end() ? &it->second : nullptr;
+        }
+
+        FileBackend::FileBackend(fs::FS &fileSystem, const String &root) :
+            _fileSystem(fileSystem),
+            _root(root),
+            _readOnly(true)
+        {
+        }
+
+        bool FileBackend::Begin(const char *name, const bool readOnly)
+        {
+            _directory = _root + "/" + name;
+            _readOnly = readOnly;
+            if (_fileSystem.exists(_directory))
+            {
+                return true;
+            }
+            if (readOnly)
+            {
+                return false;
+            }
+            _fileSystem.mkdir(_root);
+            return _fileSystem.mkdir(_directory);
+        }
+
+        void FileBackend::End()
+        {
+            _directory = "";
+        }
+
+        bool FileBackend::Exists(const char *key)
+        {
+            return !_directory.isEmpty() && _fileSystem.exists(GetPath(key));
+        }
+
+        uint32_t FileBackend::GetSize(const char *key)
+        {
+            if (!Exists(key))
+            {
+                return 0;
+            }
+            File file = _fileSystem.open(GetPath(key), FILE_READ);
+            const uint32_t size = file ? file.size() : 0;
+            file.close();
+            return size;
+        }
+
+        uint32_t FileBackend::Read(const char *key, void *data, const uint32_t size)
+        {
+            if (!Exists(key))
+            {
+                return 0;
+            }
+            File file = _fileSystem.open(GetPath(key), FILE_READ);
+            if (!file)
+            {
+                return 0;
+            }
+            const uint32_t fileSize = file.size();
+            const uint32_t result = fileSize <= size && file.read((uint8_t *)data, fileSize) == fileSize ? fileSize : 0;
+            file.close();
+            return result;
+        }
+
+        uint32_t FileBackend::Write(const char *key, const void *data, const uint32_t size)
+        {
+            return WriteAt(key, 0, data, size);
+        }
+
+        uint32_t FileBackend::ReadUInt(const char *key, const uint32_t defaultValue)
+        {
+            uint32_t value = defaultValue;
+            if (GetSize(key) == sizeof(uint32_t))
+            {
+                Read(key, &value, sizeof(uint32_t));
+            }
+            return value;
+        }
+
+        bool FileBackend::WriteUInt(const char *key, const uint32_t value)
+        {
+            return Write(key, &value, sizeof(uint32_t)) == sizeof(uint32_t);
+        }
+
+        bool FileBackend::Remove(const char *key)
+        {
+            return !_directory.isEmpty() && !_readOnly && _fileSystem.remove(GetPath(key));
+        }
+
+        bool FileBackend::SupportsPartialWrite() const
+        {
+            return true;
+        }
+
+        uint32_t FileBackend::WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size)
+        {
+            if (_directory.isEmpty() || _readOnly || (offset != 0 && offset != GetSize(key)))
+            {
+                return 0;
+            }
+
+            File file = _fileSystem.open(GetPath(key), offset == 0 ? FILE_WRITE : FILE_APPEND);
+            if (!file)
+            {
+                return 0;
+            }
+            const uint32_t result = file.write((const uint8_t *)data, size);
+            file.close();
+            return result;
+        }
+
+        String FileBackend::GetPath(const char *key) const
+        {
+            return _directory + "/" + key;
+        }
+
+#ifndef ARDUINO
+        MappedFileBackend::MappedFileBackend(const String &root) :
+            _root(root),
+            _readOnly(true)
+        {
+        }
+
+        MappedFileBackend::~MappedFileBackend()
+        {
+            End();
+        }
+
+        bool MappedFileBackend::Begin(const char *name, const bool readOnly)
+        {
+            End();
+            _directory = _root + "/" + name;
+            _readOnly = readOnly;
+
+            struct stat info;
+            if (stat(_directory.c_str(), &info) == 0)
+            {
+                return S_ISDIR(info.st_mode);
+            }
+            if (readOnly)
+            {
+                _directory = "";
+                return false;
+            }
+            mkdir(_root.c_str(), 0755);
+            return mkdir(_directory.c_str(), 0755) == 0;
+        }
+
+        void MappedFileBackend::End()
+        {
+            for (auto &mapping : _mappings)
+            {
+                munmap(mapping.second.Data, mapping.second.Size);
+            }
+            _mappings.clear();
+            _directory = "";
+        }
+
+        bool MappedFileBackend::Exists(const char *key)
+        {
+            return GetSize(key) > 0;
+        }
+
+        uint32_t MappedFileBackend::GetSize(const char *key)
+        {
+            struct stat info;
+            if (_directory.isEmpty() || stat(GetPath(key).c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+            {
+                return 0;
+            }
+            return info.st_size;
+        }
+
+        uint32_t MappedFileBackend::Read(const char *key, void *data, const uint32_t size)
+        {
+            uint32_t valueSize = 0;
+            const uint8_t *value = Map(key, valueSize);
+            if (value == nullptr || valueSize > size)
+            {
+                return 0;
+            }
+            memcpy(data, value, valueSize);
+            return valueSize;
+        }
+
+        uint32_t MappedFileBackend::Write(const char *key, const void *data, const uint32_t size)
+        {
+            return WriteAt(key, 0, data, size);
+        }
+
+        uint32_t MappedFileBackend::ReadUInt(const char *key, const uint32_t defaultValue)
+        {
+            uint32_t value = defaultValue;
+            if (GetSize(key) == sizeof(uint32_t))
+            {
+                Read(key, &value, sizeof(uint32_t));
+            }
+            return value;
+        }
+
+        bool MappedFileBackend::WriteUInt(const char *key, const uint32_t value)
+        {
+            return Write(key, &value, sizeof(uint32_t)) == sizeof(uint32_t);
+        }
+
+        bool MappedFileBackend::Remove(const char *key)
+        {
+            if (_directory.isEmpty() || _readOnly)
+            {
+                return false;
+            }
+            Unmap(key);
+            return unlink(GetPath(key).c_str()) == 0;
+        }
+
+        bool MappedFileBackend::SupportsPartialWrite() const
+        {
+            return true;
+        }
+
+        uint32_t MappedFileBackend::WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size)
+        {
+            if (_directory.isEmpty() || _readOnly || (offset != 0 && offset != GetSize(key)))
+            {
+                return 0;
+            }
+            Unmap(key);
+
+            // a new value is written next to the old one and replaces it at once
+            const String path = GetPath(key);
+            const String writePath = offset == 0 ? path + ".tmp" : path;
+            const int file = open(writePath.c_str(), offset == 0 ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY | O_APPEND, 0644);
+            if (file < 0)
+            {
+                return 0;
+            }
+            const bool written = write(file, data, size) == (ssize_t)size;
+            close(file);
+            if (!written || (offset == 0 && rename(writePath.c_str(), path.c_str()) != 0))
+            {
+                return 0;
+            }
+            return size;
+        }
+
+        const uint8_t *MappedFileBackend::Map(const char *key, uint32_t &size)
+        {
+            size = 0;
+            auto it = _mappings.find(key);
+            if (it != _mappings.end())
+            {
+                size = it->second.Size;
+                return (const uint8_t *)it->second.Data;
+            }
+
+            // an empty file cannot be mapped, it does not exist for the storage either
+            const uint32_t fileSize = GetSize(key);
+            const int file = fileSize > 0 ? open(GetPath(key).c_str(), O_RDONLY) : -1;
+            if (file < 0)
+            {
+                return nullptr;
+            }
+            void *data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, file, 0);
+            close(file);
+            if (data == MAP_FAILED)
+            {
+                return nullptr;
+            }
+
+            _mappings[key] = {data, fileSize};
+            size = fileSize;
+            return (const uint8_t *)data;
+        }
+
+        String MappedFileBackend::GetPath(const char *key) const
+        {
+            return _directory + "/" + key;
+        }
+
+        void MappedFileBackend::Unmap(const String &key)
+        {
+            auto it = _mappings.find(key);
+            if (it != _mappings.end())
+            {
+                munmap(it->second.Data, it->second.Size);
+                _mappings.erase(it);
+            }
+        }
+#endif
+    }
+}
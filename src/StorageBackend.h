@@ -0,0 +1,165 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+#include <map>
+#include <vector>
+#include <Preferences.h>
+
+namespace esp32
+{
+    namespace foundation
+    {
+        // Persists the blobs and counters of a KeyValueStorage. Every access is enclosed by Begin() and
+        // End() with the name of the storage, which selects an independent set of keys (a namespace).
+        class StorageBackend
+        {
+        public:
+            virtual ~StorageBackend() {}
+
+            virtual bool Begin(const char *name, const bool readOnly) = 0;
+            virtual void End() = 0;
+
+            virtual bool Exists(const char *key) = 0;
+
+            // 0 if the key does not exist
+            virtual uint32_t GetSize(const char *key) = 0;
+
+            // reads the whole value, returns 0 if it is larger than size
+            virtual uint32_t Read(const char *key, void *data, const uint32_t size) = 0;
+            virtual uint32_t Write(const char *key, const void *data, const uint32_t size) = 0;
+
+            virtual uint32_t ReadUInt(const char *key, const uint32_t defaultValue) = 0;
+            virtual bool WriteUInt(const char *key, const uint32_t value) = 0;
+
+            virtual bool Remove(const char *key) = 0;
+
+            // Optional: writes a part of a value, offset 0 replaces the value and
+            // any other offset has to equal its current size to append to it.
+            virtual bool SupportsPartialWrite() const;
+            virtual uint32_t WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size);
+
+            // Optional: maps the whole value into memory instead of copying it, nullptr if the backend
+            // cannot. The mapping stays valid until the key is written or removed or End() is called.
+            virtual const uint8_t *Map(const char *key, uint32_t &size);
+        };
+
+        // the NVS partition of the ESP32, the default backend
+        class PreferencesBackend : public StorageBackend
+        {
+        public:
+            virtual bool Begin(const char *name, const bool readOnly) override;
+            virtual void End() override;
+            virtual bool Exists(const char *key) override;
+            virtual uint32_t GetSize(const char *key) override;
+            virtual uint32_t Read(const char *key, void *data, const uint32_t size) override;
+            virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override;
+            virtual uint32_t ReadUInt(const char *key, const uint32_t defaultValue) override;
+            virtual bool WriteUInt(const char *key, const uint32_t value) override;
+            virtual bool Remove(const char *key) override;
+
+        private:
+            Preferences _pref;
+        };
+
+        // Keeps everything in RAM until it is destroyed, e.g. to measure the storage engine without
+        // the flash or to share volatile settings. One instance can serve several storages.
+        class RamBackend : public StorageBackend
+        {
+        public:
+            RamBackend();
+
+            virtual bool Begin(const char *name, const bool readOnly) override;
+            virtual void End() override;
+            virtual bool Exists(const char *key) override;
+            virtual uint32_t GetSize(const char *key) override;
+            virtual uint32_t Read(const char *key, void *data, const uint32_t size) override;
+            virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override;
+            virtual uint32_t ReadUInt(const char *key, const uint32_t defaultValue) override;
+            virtual bool WriteUInt(const char *key, const uint32_t value) override;
+            virtual bool Remove(const char *key) override;
+            virtual bool SupportsPartialWrite() const override;
+            virtual uint32_t WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size) override;
+
+            // bytes held by all namespaces
+            uint32_t GetUsedBytes() const;
+
+        private:
+            const std::vector<uint8_t> *Find(const char *key) const;
+
+        private:
+            std::map<String, std::map<String, std::vector<uint8_t>>> _namespaces;
+            std::map<String, std::vector<uint8_t>> *_current;
+            bool _readOnly;
+        };
+
+        // One file per key in <root>/<name>/ of a file system, e.g. LittleFS or an SD card.
+        // The file system has to be mounted before the storage is loaded.
+        class FileBackend : public StorageBackend
+        {
+        public:
+            FileBackend(fs::FS &fileSystem, const String &root = "/kvs");
+
+            virtual bool Begin(const char *name, const bool readOnly) override;
+            virtual void End() override;
+            virtual bool Exists(const char *key) override;
+            virtual uint32_t GetSize(const char *key) override;
+            virtual uint32_t Read(const char *key, void *data, const uint32_t size) override;
+            virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override;
+            virtual uint32_t ReadUInt(const char *key, const uint32_t defaultValue) override;
+            virtual bool WriteUInt(const char *key, const uint32_t value) override;
+            virtual bool Remove(const char *key) override;
+            virtual bool SupportsPartialWrite() const override;
+            virtual uint32_t WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size) override;
+
+        private:
+            String GetPath(const char *key) const;
+
+        private:
+            fs::FS &_fileSystem;
+            String _root;
+            String _directory;
+            bool _readOnly;
+        };
+
+#ifndef ARDUINO
+        // One file per key in <root>/<name>/ of a POSIX host. The values are read through mmap(),
+        // so a compressed blob is decompressed without copying it first. A value is replaced by
+        // writing a new file and renaming it over the old one.
+        class MappedFileBackend : public StorageBackend
+        {
+        public:
+            MappedFileBackend(const String &root);
+            virtual ~MappedFileBackend();
+
+            virtual bool Begin(const char *name, const bool readOnly) override;
+            virtual void End() override;
+            virtual bool Exists(const char *key) override;
+            virtual uint32_t GetSize(const char *key) override;
+            virtual uint32_t Read(const char *key, void *data, const uint32_t size) override;
+            virtual uint32_t Write(const char *key, const void *data, const uint32_t size) override;
+            virtual uint32_t ReadUInt(const char *key, const uint32_t defaultValue) override;
+            virtual bool WriteUInt(const char *key, const uint32_t value) override;
+            virtual bool Remove(const char *key) override;
+            virtual bool SupportsPartialWrite() const override;
+            virtual uint32_t WriteAt(const char *key, const uint32_t offset, const void *data, const uint32_t size) override;
+            virtual const uint8_t *Map(const char *key, uint32_t &size) override;
+
+        private:
+            String GetPath(const char *key) const;
+            void Unmap(const String &key);
+
+        private:
+            struct Mapping
+            {
+                void *Data;
+                uint32_t Size;
+            };
+
+            String _root;
+            String _directory;
+            bool _readOnly;
+            std::map<String, Mapping> _mappings;
+        };
+#endif
+    }
+}
@@ -0,0 +1,102 @@
+#include "StorageManager.h"
+#include <algorithm>
+#include <cinttypes>
+
+namespace esp32
+{
+    namespace foundation
+    {
+        StorageManager::StorageManager()
+            : _report()
+        {
+        }
+
+        void StorageManager::Add(KeyValueStorage &storage)
+        {
+            if (std::find(_storages.begin(), _storages.end(), &storage) == _storages.end())
+            {
+                _storages.push_back(&storage);
+            }
+        }
+
+        void StorageManager::Remove(KeyValueStorage &storage)
+        {
+            _storages.erase(std::remove(_storages.begin(), _storages.end(), &storage), _storages.end());
+        }
+
+        uint32_t StorageManager::LoadAll()
+        {
+            _report = StorageReport();
+            _report.StorageCount = _storages.size();
+            _report.Success = true;
+
+            const uint32_t start = micros();
+            for (auto *storage : _storages)
+            {
+                if (storage->Load())
+                {
+                    _report.ActiveCount++;
+                }
+            }
+            _report.FlashMicros = micros() - start;
+            return _report.ActiveCount;
+        }
+
+        bool StorageManager::SaveAll()
+        {
+            _report = StorageReport();
+            _report.StorageCount = _storages.size();
+            _report.Success = true;
+
+            // the save mutexes are always taken in the same order, a single Save() only takes its own
+            std::vector<std::vector<KeyValueStorage::PendingWrite>> writes(_storages.size());
+            std::vector<SemaphoreHandle_t> saveMutexes(_storages.size());
+            uint32_t start = micros();
+            for (uint32_t i = 0; i < _storages.size(); i++)
+            {
+                saveMutexes[i] = KeyValueStorage::TakeMutex(_storages[i]->_saveMutex);
+                _storages[i]->BeginSave(writes[i]);
+                if (!writes[i].empty())
+                {
+                    _report.ActiveCount++;
+                    _report.WriteCount += writes[i].size();
+                }
+            }
+            _report.PrepareMicros = micros() - start;
+
+            start = micros();
+            for (uint32_t i = 0; i < _storages.size(); i++)
+            {
+                // the telemetry also counts the chunks of streamed blobs and the counters
+                const uint64_t bytesWritten = _storages[i]->_telemetry.BytesWritten;
+                _report.Success &= _storages[i]->EndSave(writes[i]);
+                _report.ByteCount += _storages[i]->_telemetry.BytesWritten - bytesWritten;
+            }
+            _report.FlashMicros = micros() - start;
+
+            for (uint32_t i = _storages.size(); i > 0; i--)
+            {
+                KeyValueStorage::GiveMutex(saveMutexes[i - 1]);
+            }
+            return _report.Success;
+        }
+
+        const StorageReport &StorageManager::GetReport() const
+        {
+            return _report;
+        }
+
+        void StorageManager::PrintReport(HardwareSerial &serial) const
+        {
+            serial.printf(
+                "storages: %" PRIu32 ", active: %" PRIu32 ", writes: %" PRIu32 ", bytes: %" PRIu32 ", prepare: %" PRIu32 " us, flash: %" PRIu32 " us%s\n",
+                _report.StorageCount,
+                _report.ActiveCount,
+                _report.WriteCount,
+                _report.ByteCount,
+                _report.PrepareMicros,
+                _report.FlashMicros,
+                _report.Success ? "" : ", failed");
+        }
+    }
+}
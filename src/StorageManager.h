@@ -0,0 +1,46 @@
+#pragma once
+#include "KeyValueStorage.h"
+#include <vector>
+
+namespace esp32
+{
+    namespace foundation
+    {
+        // result of the last LoadAll() or SaveAll(), ActiveCount is the number of storages that were
+        // loaded or had something to write, FlashMicros the time spent reading or writing the flash
+        struct StorageReport
+        {
+            uint32_t StorageCount;
+            uint32_t ActiveCount;
+            uint32_t WriteCount;
+            uint32_t ByteCount;
+            uint32_t PrepareMicros;
+            uint32_t FlashMicros;
+            bool Success;
+        };
+
+        // Loads and saves several storages in one pass. SaveAll() collects the writes of all
+        // storages first and then commits them back to back, so the flash is busy for one
+        // period only. Every storage keeps its own namespace, a failed commit does not
+        // revert the storages that were committed before.
+        class StorageManager
+        {
+        public:
+            StorageManager();
+
+            void Add(KeyValueStorage &storage);
+            void Remove(KeyValueStorage &storage);
+
+            // returns the number of storages that were loaded by this call
+            uint32_t LoadAll();
+            bool SaveAll();
+
+            const StorageReport &GetReport() const;
+            void PrintReport(HardwareSerial &serial) const;
+
+        private:
+            std::vector<KeyValueStorage *> _storages;
+            StorageReport _report;
+        };
+    }
+}
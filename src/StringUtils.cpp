@@ -1,6 +1,8 @@
 #include "StringUtils.h"
 #include <sstream>
 
+static const char *base64Chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
 namespace esp32
 {
     namespace foundation
@@ -11,7 +13,7 @@ namespace esp32
             if (idx > -1)
             {
                 key = input.substring(0, idx);
-                value = (idx + 1 < input.length()) ? input.substring(idx + 1) : "";
+                value = ((uint32_t)idx + 1 < input.length()) ? input.substring(idx + 1) : "";
                 return true;
             }
 
@@ -23,11 +25,70 @@ namespace esp32
         String StringUtils::PrependZeros(const String& input, const int totalLength)
         {
             String result = input;
-            while (result.length() < totalLength)
+            while ((int)result.length() < totalLength)
             {
                 result = "0" + result;
             }
             return result;
         }
+
+        String StringUtils::ToBase64(const uint8_t *data, const uint32_t size)
+        {
+            String result;
+            result.reserve((size + 2) / 3 * 4);
+            for (uint32_t i = 0; i < size; i += 3)
+            {
+                const uint32_t bits = (data[i] << 16) | (i + 1 < size ? data[i + 1] << 8 : 0) | (i + 2 < size ? data[i + 2] : 0);
+                result += base64Chars[(bits >> 18) & 0x3F];
+                result += base64Chars[(bits >> 12) & 0x3F];
+                result += i + 1 < size ? base64Chars[(bits >> 6) & 0x3F] : '=';
+                result += i + 2 < size ? base64Chars[bits & 0x3F] : '=';
+            }
+            return result;
+        }
+
+        bool StringUtils::FromBase64(const String &input, std::vector<uint8_t> &result)
+        {
+            result.clear();
+            result.reserve(input.length() / 4 * 3);
+            uint32_t bits = 0;
+            uint32_t count = 0;
+            uint32_t padding = 0;
+            for (uint32_t i = 0; i < input.length(); i++)
+            {
+                const char c = input[i];
+                if (isspace(c))
+                {
+                    continue;
+                }
+
+                const char *pos = strchr(base64Chars, c);
+                if (c == '=')
+                {
+                    padding++;
+                }
+                else if (c == 0 || pos == nullptr || padding > 0)
+                {
+                    return false;
+                }
+
+                bits = (bits << 6) | (c == '=' ? 0 : pos - base64Chars);
+                if (++count == 4)
+                {
+                    result.push_back(bits >> 16);
+                    result.push_back(bits >> 8);
+                    result.push_back(bits);
+                    bits = 0;
+                    count = 0;
+                }
+            }
+
+            if (count != 0 || padding > 2)
+            {
+                return false;
+            }
+            result.resize(result.size() - padding);
+            return true;
+        }
     }
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <Arduino.h>
+#include <vector>
 
 namespace esp32
 {
@@ -17,6 +18,15 @@ namespace esp32
             static String PrependZeros(
                 const String& input,
                 const int totalLength);
+
+            // standard alphabet with padding, whitespace in the input is ignored
+            static String ToBase64(
+                const uint8_t *data,
+                const uint32_t size);
+
+            static bool FromBase64(
+                const String &input,
+                std::vector<uint8_t> &result);
         };
     }
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "WiFiSmartClient.h"
+#include "HeapStats.h"
 
 namespace esp32
 {
@@ -19,6 +20,7 @@ namespace esp32
                 const String &hostName,
                 const uint32_t timeoutInMillis)
         {
+            HeapScope heapScope(HS_WIFI_CLIENT);
             if (_wifiSSID != wifiSSID || _wifiKey != wifiKey || _hostName != hostName)
             {
                 Disconnect();
@@ -59,6 +61,7 @@ namespace esp32
 
         void WiFiSmartClient::Disconnect()
         {
+            HeapScope heapScope(HS_WIFI_CLIENT);
             for (auto &eventId : _eventIds)
             {
                 WiFi.removeEvent(eventId);
@@ -74,6 +77,7 @@ namespace esp32
 
         std::vector<String> WiFiSmartClient::ScanNetworks()
         {
+            HeapScope heapScope(HS_WIFI_CLIENT);
             WiFi.scanDelete();
             const int16_t numWifis = WiFi.scanNetworks(false, false);
             std::vector<String> result;